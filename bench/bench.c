@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../src/upool.h"
+
+/* Capacity of the pools of the bounded queue. */
+#define BENCH_CAPACITY 4096
+
+/* Fan width, submit to start samples and fan rounds. */
+#define BENCH_FAN_WIDTH 64
+#define BENCH_LATENCY_SAMPLES 10000
+#define BENCH_FAN_ROUNDS 10000
+
+typedef struct {
+    up_pool_t *pool;
+    size_t tasks_count;
+    int lanes;
+    pthread_barrier_t *start;
+} ProducerContext;
+
+typedef struct {
+    unsigned long submitted;
+    unsigned long started;
+} LatencyContext;
+
+unsigned long bench_clock_ns();
+size_t bench_next(size_t n, size_t max);
+up_pool_t *bench_create_pool(int bounded, size_t workers);
+size_t bench_resident_bytes();
+
+void bench_throughput(int bounded, int lanes, size_t producers, size_t workers,
+                      size_t tasks);
+void bench_latency(int bounded, size_t workers);
+void bench_fan(int bounded, size_t workers);
+void bench_memory(int bounded, size_t tasks);
+
+void task_empty(void *arg);
+void task_stamp(void *arg);
+void task_block(void *arg);
+void *producer_routine(void *arg);
+int compare_ns(const void *a, const void *b);
+
+/* Print the results as CSV, for every queue and up to `max_producers`
+ * producers and `max_workers` workers, doubling them at each step:
+ *
+ *     bench [max_producers [max_workers [tasks]]]
+ */
+int main(int argc, char *argv[])
+{
+    int bounded;
+    size_t p, w, tasks, max_producers, max_workers;
+    long cpus;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    max_producers = argc > 1 ? strtoul(argv[1], NULL, 10) : (size_t) (cpus > 0 ? cpus : 1);
+    max_workers = argc > 2 ? strtoul(argv[2], NULL, 10) : max_producers;
+    tasks = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000000;
+
+    if (max_producers == 0 || max_workers == 0 || tasks == 0) {
+        fprintf(stderr, "usage: %s [max_producers [max_workers [tasks]]]\n", argv[0]);
+        return 1;
+    }
+
+    printf("benchmark,queue,producers,workers,tasks,metric,value\n");
+
+    /* First, while no freed memory can be reused. */
+    for (bounded = 1; bounded >= 0; bounded--) {
+        bench_memory(bounded, tasks);
+    }
+
+    for (bounded = 0; bounded <= 1; bounded++) {
+        for (w = 1; w <= max_workers; w = bench_next(w, max_workers)) {
+            for (p = 1; p <= max_producers; p = bench_next(p, max_producers)) {
+                bench_throughput(bounded, 0, p, w, tasks);
+            }
+
+            bench_latency(bounded, w);
+            bench_fan(bounded, w);
+        }
+    }
+
+    for (w = 1; w <= max_workers; w = bench_next(w, max_workers)) {
+        for (p = 1; p <= max_producers; p = bench_next(p, max_producers)) {
+            bench_throughput(0, 1, p, w, tasks);
+        }
+    }
+
+    return 0;
+}
+
+/* Return a monotonic time in nanoseconds. */
+unsigned long bench_clock_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long) ts.tv_sec * 1000000000UL + (unsigned long) ts.tv_nsec;
+}
+
+/* Return the double of `n` up to `max`, past `max` after it. */
+size_t bench_next(size_t n, size_t max)
+{
+    if (n == max) {
+        return max + 1;
+    }
+
+    return n * 2 < max ? n * 2 : max;
+}
+
+up_pool_t *bench_create_pool(int bounded, size_t workers)
+{
+    int retv;
+    up_pool_t *pool;
+
+    if (bounded) {
+        retv = up_pool_create_bounded(&pool, workers, BENCH_CAPACITY);
+    } else {
+        retv = up_pool_create(&pool, workers);
+    }
+
+    if (retv != UP_SUCCESS) {
+        fprintf(stderr, "bench_create_pool: %d\n", retv);
+        exit(1);
+    }
+
+    return pool;
+}
+
+/* Return the resident set size of the process. */
+size_t bench_resident_bytes()
+{
+    FILE *f;
+    unsigned long size, resident;
+
+    f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+
+    fclose(f);
+
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+/* Empty tasks per second, from the first submit to the last completion.
+ * With `lanes` set each producer submits through its own lane. */
+void bench_throughput(int bounded, int lanes, size_t producers, size_t workers,
+                      size_t tasks)
+{
+    size_t i;
+    unsigned long start, end;
+    up_pool_t *pool;
+    pthread_t *threads;
+    pthread_barrier_t barrier;
+    ProducerContext c;
+
+    pool = bench_create_pool(bounded, workers);
+
+    pthread_barrier_init(&barrier, NULL, (unsigned int) producers + 1);
+
+    c.pool = pool;
+    c.tasks_count = tasks / producers;
+    c.lanes = lanes;
+    c.start = &barrier;
+
+    threads = (pthread_t *) malloc(producers * sizeof(pthread_t));
+    for (i = 0; i < producers; i++) {
+        pthread_create(&threads[i], NULL, producer_routine, (void *) &c);
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = bench_clock_ns();
+
+    for (i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    up_pool_wait(pool);
+    end = bench_clock_ns();
+
+    printf("throughput,%s,%lu,%lu,%lu,tasks_per_sec,%.0f\n",
+           lanes ? "lanes" : bounded ? "bounded" : "unbounded",
+           (unsigned long) producers, (unsigned long) workers,
+           (unsigned long) (c.tasks_count * producers),
+           (double) (c.tasks_count * producers) * 1e9 / (double) (end - start));
+
+    up_pool_destroy(pool);
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+}
+
+/* Percentiles of the time from submit to start of a task, submitted
+ * to an idle pool. */
+void bench_latency(int bounded, size_t workers)
+{
+    size_t i;
+    unsigned long *samples;
+    up_pool_t *pool;
+    LatencyContext c;
+
+    const double PERCENTILES[] = {50, 90, 99, 99.9, 100};
+    const char *NAMES[] = {"p50_ns", "p90_ns", "p99_ns", "p999_ns", "max_ns"};
+
+    pool = bench_create_pool(bounded, workers);
+    samples = (unsigned long *) malloc(BENCH_LATENCY_SAMPLES * sizeof(unsigned long));
+
+    for (i = 0; i < BENCH_LATENCY_SAMPLES; i++) {
+        c.submitted = bench_clock_ns();
+        up_pool_submit(pool, task_stamp, (void *) &c);
+        up_pool_wait(pool);
+
+        samples[i] = c.started - c.submitted;
+    }
+
+    qsort(samples, BENCH_LATENCY_SAMPLES, sizeof(unsigned long), compare_ns);
+
+    for (i = 0; i < sizeof(PERCENTILES) / sizeof(PERCENTILES[0]); i++) {
+        printf("latency,%s,1,%lu,%d,%s,%lu\n",
+               bounded ? "bounded" : "unbounded", (unsigned long) workers,
+               BENCH_LATENCY_SAMPLES, NAMES[i],
+               samples[(size_t) ((BENCH_LATENCY_SAMPLES - 1) * PERCENTILES[i] / 100)]);
+    }
+
+    up_pool_destroy(pool);
+    free(samples);
+}
+
+/* Time to submit a batch of empty tasks and wait for all of them. */
+void bench_fan(int bounded, size_t workers)
+{
+    size_t i;
+    unsigned long start, end;
+    up_pool_t *pool;
+    void *args[BENCH_FAN_WIDTH];
+    void (*routines[BENCH_FAN_WIDTH]) (void *);
+
+    pool = bench_create_pool(bounded, workers);
+
+    for (i = 0; i < BENCH_FAN_WIDTH; i++) {
+        routines[i] = task_empty;
+        args[i] = NULL;
+    }
+
+    start = bench_clock_ns();
+
+    for (i = 0; i < BENCH_FAN_ROUNDS; i++) {
+        up_pool_submit_batch(pool, routines, args, BENCH_FAN_WIDTH);
+        up_pool_wait(pool);
+    }
+
+    end = bench_clock_ns();
+
+    printf("fan,%s,1,%lu,%d,ns_per_round,%lu\n",
+           bounded ? "bounded" : "unbounded", (unsigned long) workers,
+           BENCH_FAN_WIDTH * BENCH_FAN_ROUNDS, (end - start) / BENCH_FAN_ROUNDS);
+
+    up_pool_destroy(pool);
+}
+
+/* Resident memory per queued task, while the only worker is blocked.
+ * The bounded queue allocates its ring up front, so there the pool's
+ * creation is measured too. */
+void bench_memory(int bounded, size_t tasks)
+{
+    int block;
+    size_t i, before, after;
+    up_pool_t *pool;
+
+    if (bounded) {
+        tasks = BENCH_CAPACITY - 1;
+    }
+
+    before = bench_resident_bytes();
+
+    pool = bench_create_pool(bounded, 1);
+
+    block = 1;
+    up_pool_submit(pool, task_block, (void *) &block);
+
+    for (i = 0; i < tasks; i++) {
+        up_pool_submit(pool, task_empty, NULL);
+    }
+
+    after = bench_resident_bytes();
+
+    __atomic_store_n(&block, 0, __ATOMIC_SEQ_CST);
+    up_pool_wait(pool);
+
+    printf("memory,%s,1,1,%lu,bytes_per_task,%.1f\n",
+           bounded ? "bounded" : "unbounded", (unsigned long) tasks,
+           (double) (after - before) / (double) tasks);
+
+    up_pool_destroy(pool);
+}
+
+void task_empty(void *arg)
+{
+}
+
+void task_stamp(void *arg)
+{
+    ((LatencyContext *) arg)->started = bench_clock_ns();
+}
+
+void task_block(void *arg)
+{
+    while (__atomic_load_n((int *) arg, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+}
+
+void *producer_routine(void *arg)
+{
+    size_t i;
+    up_producer_t *producer;
+    ProducerContext *c = (ProducerContext *) arg;
+
+    if (c->lanes) {
+        up_pool_producer_register(c->pool, &producer);
+    }
+
+    pthread_barrier_wait(c->start);
+
+    for (i = 0; i < c->tasks_count; i++) {
+        if (c->lanes) {
+            up_producer_submit(producer, task_empty, NULL);
+        } else {
+            up_pool_submit(c->pool, task_empty, NULL);
+        }
+    }
+
+    if (c->lanes) {
+        up_pool_producer_unregister(producer);
+    }
+
+    return NULL;
+}
+
+int compare_ns(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *) a;
+    unsigned long y = *(const unsigned long *) b;
+
+    return x < y ? -1 : x > y;
+}
@@ -23,7 +23,7 @@ void consumer_routine_opposite(void *arg);
 
 int main()
 {
-    size_t i, s;
+    size_t i;
     up_pool_t *pool;
     ConsumerContext *c;
     ProducerContext *p;
@@ -64,9 +64,7 @@ int main()
     }
 
     /* Wait for Pool. */
-    do {
-        up_pool_queue_size(pool, &s);
-    } while (s != 0);
+    up_pool_wait(pool);
 
     for (i = 0; i < INPUT_SIZE; i++) {
         printf("(%d, %d)\n", c[i].in, c[i].out);
@@ -20,6 +20,17 @@
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <ucontext.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#endif
 
 #include "upool.h"
 
@@ -30,339 +41,5024 @@
 #define up_handle_error(msg, retv) \
     do { perror(msg); return retv; } while (0)
 
+/* Size of a cache line, used to keep concurrently written fields apart. */
+#define UP_CACHE_LINE 64
+
+#define up_cache_aligned __attribute__((aligned(UP_CACHE_LINE)))
+
+/* Initial number of tasks of a worker's deque. */
+#define UP_DEQUE_SIZE 256
+
+/* Returned by the dequeue functions when the queue is empty. */
+#define UP_DEQ_EMPTY 1
+
+/* Number of task handles allocated at once. */
+#define UP_HANDLE_SLAB 64
+
+/* Number of tasks taken from higher levels while a priority level is not
+ * empty before the level is served first. */
+#define UP_PRIO_AGING 32
+
+/* Default number of queued tasks above which an elastic pool grows. */
+#define UP_GROW_DEPTH 32
+
+/* Default time in nanoseconds after which an idle worker of an elastic
+ * pool retires. */
+#define UP_IDLE_NS 1000000000UL
+
+/* States of a worker's thread. */
+#define UP_WORKER_STOPPED 0               /* Not started or joined. */
+#define UP_WORKER_RUNNING 1
+#define UP_WORKER_EXITED 2                /* Retired, to be joined. */
+
+/* Default time in nanoseconds an idle worker spins before parking. */
+#define UP_SPIN_NS 20000
+
+/* Resolution of the timer wheel in nanoseconds. */
+#define UP_TIMER_TICK_NS 1000000UL
+
+/* Levels of the timer wheel, each one spans `UP_WHEEL_SLOTS` times the
+ * ticks of the one below. */
+#define UP_WHEEL_LEVELS 4
+#define UP_WHEEL_BITS 6
+#define UP_WHEEL_SLOTS (1 << UP_WHEEL_BITS)
+#define UP_WHEEL_MASK (UP_WHEEL_SLOTS - 1)
+
+/* Maximum number of producers registered at once, and number of tasks of
+ * each one's lane. */
+#define UP_LANES_MAX 64
+#define UP_LANE_SIZE 1024
+
+/* Maximum number of task groups of a pool. */
+#define UP_GROUPS_MAX 64
+
+/* Capacity of a `UP_QUEUE_RING` queue of `up_pool_attr_init`. */
+#define UP_QUEUE_CAPACITY 1024
+
+/* Number of strands of a pool, a power of two, and tasks a strand runs
+ * in a row before letting other tasks run. */
+#define UP_STRANDS 1024
+#define UP_STRAND_BATCH 32
+
+/* Stack size of the fibers of `up_pool_submit_fiber`. */
+#define UP_FIBER_STACK (64 * 1024)
+
+/* Alignment of the allocations of the worker arenas and size of their
+ * first block. */
+#define UP_ARENA_ALIGN 16
+#define UP_ARENA_BLOCK (64 * 1024)
+
+/* Why a fiber switched back to its worker. */
+#define UP_FIBER_RUNNING 0
+#define UP_FIBER_DONE 1                   /* Its task returned. */
+#define UP_FIBER_YIELDED 2                /* Called `up_task_yield`. */
+#define UP_FIBER_SUSPENDED 3              /* Waits for `awaited`. */
+
+/* Add `n` to a statistic written by its owner thread only. Readers see
+ * whole values, without the cost of a locked instruction. */
+#define up_stat_add(var, n) \
+    __atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+/* Hint the CPU that the caller is busy waiting. */
+#if defined(__x86_64__) || defined(__i386__)
+#define up_cpu_relax() __builtin_ia32_pause()
+#else
+#define up_cpu_relax() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
 
 /* A task to be executed. */
 typedef struct up_task {
     void (*task_routine) (void *);        /* Pointer to the routine to execute. */
     void *arg;                            /* Pointer to the arg of the routine. */
+    unsigned long stamp;                  /* Submit time, 0 if not timed. */
+    union {
+        unsigned char bytes[UP_INLINE_SIZE];
+        void *p;
+        long l;
+        double d;
+    } data;                               /* Arg copied by `up_pool_submit_copy`. */
 } up_task_t;
 
+/* The `arg` of tasks whose arg is in their `data`. */
+static char up_inline_arg;
+#define UP_INLINE_ARG ((void *) &up_inline_arg)
+
 /* A node of the task queue (linked list). */
 typedef struct up_node {
     up_task_t task;                       /* The task to be executed. */
     struct up_node *next;                 /* Pointer to the next queue node. */
 } up_node_t;
 
+/* A task queue (linked list) behind a single lock. */
+typedef struct up_queue {
+    pthread_mutex_t lock;                 /* Lock of the queue. */
+    up_node_t *head, *tail;               /* Queue's head, tail, NULL if empty. */
+    size_t size;                          /* Number of queued tasks. */
+} up_queue_t;
+
+/* A priority level.
+ *
+ * `UP_PRIO_NORMAL` tasks live in the pool's main queue and deques, for
+ * that level only `age` is used.
+ */
+typedef struct up_level {
+    up_queue_t queue;                     /* Tasks of the level. */
+    size_t age;                           /* Tasks taken from higher levels meanwhile. */
+} up_level_t;
+
+/* A slot of the bounded task queue (ring buffer). Slots are not padded,
+ * only the ring's positions, written by every producer or consumer, are
+ * kept on cache lines of their own. */
+typedef struct up_cell {
+    size_t seq;                           /* Sequence number of the slot. */
+    up_task_t task;                       /* The task to be executed. */
+} up_cell_t;
+
+/* A bounded multi-producer multi-consumer task queue.
+ *
+ * The algorithm is Dmitry Vyukov's bounded MPMC queue: every cell carries a
+ * sequence number that tells producers and consumers, racing on `enq_pos`
+ * and `deq_pos` with CAS, whether the cell is free or full for their lap.
+ */
+typedef struct up_ring {
+    up_cell_t *cells;                     /* Preallocated array of cells. */
+    size_t mask;                          /* Number of cells minus one. */
+    size_t enq_pos up_cache_aligned;      /* Next position to enqueue to. */
+    size_t deq_pos up_cache_aligned;      /* Next position to dequeue from. */
+} up_ring_t;
+
+/* The circular array of a worker's deque. */
+typedef struct up_deque_array {
+    size_t mask;                          /* Number of tasks minus one. */
+    up_task_t *tasks;                     /* Array of tasks. */
+    struct up_deque_array *prev;          /* Smaller array replaced by this one. */
+} up_deque_array_t;
+
+/* A work-stealing deque.
+ *
+ * This is the Chase-Lev deque: the owner pushes and takes tasks at the
+ * `bottom` without locks, while thieves steal from the `top` with a CAS.
+ * Only the owner grows the array, the old ones are kept until the pool is
+ * destroyed since a thief may still be reading from them.
+ */
+typedef struct up_deque {
+    long top up_cache_aligned;            /* Index of the next task to steal. */
+    long bottom up_cache_aligned;         /* Index of the next task to push. */
+    up_deque_array_t *array;              /* Current array of tasks. */
+} up_deque_t;
+
+/* A NUMA node of the pool. */
+typedef struct up_domain {
+    up_queue_t queue;                     /* Tasks submitted to the node. */
+#ifdef __linux__
+    cpu_set_t cpus;                       /* CPUs of the node the pool may use. */
+#endif
+} up_domain_t;
+
+/* A task running on a stack of its own, see `up_pool_submit_fiber`. */
+typedef struct up_fiber {
+    ucontext_t ctx;                       /* Context of the fiber, when switched out. */
+    char *stack;                          /* Stack of `UP_FIBER_STACK` bytes. */
+    up_task_t task;                       /* Task the fiber runs. */
+    int state;                            /* Why the fiber switched out. */
+    struct up_task_handle *awaited;       /* Handle a suspended fiber waits for. */
+    up_pool_t *pool;                      /* Pool the fiber belongs to. */
+    struct up_fiber *next;                /* Next fiber of a ready or free list. */
+    struct up_fiber *all;                 /* Next fiber allocated by the pool. */
+} up_fiber_t;
+
+/* Routine and arg of a fiber task, in the `data` of the task. */
+typedef struct up_fiber_entry {
+    void (*task_routine) (void *);
+    void *arg;
+} up_fiber_entry_t;
+
+/* A task group, see `up_pool_group_create`. */
+struct up_group {
+    up_queue_t queue;                     /* Tasks submitted to the group. */
+    size_t weight;                        /* Tasks served per round. */
+    size_t deficit;                       /* Tasks left to serve this round. */
+    int used;                             /* If set the group is created. */
+    up_pool_t *pool;                      /* Pool the group belongs to. */
+};
+
+/* A serial queue of keyed tasks, see `up_pool_submit_keyed`. */
+typedef struct up_strand {
+    up_queue_t queue;                     /* Tasks of the keys of the strand. */
+    size_t pending;                       /* Tasks queued or running. */
+    up_pool_t *pool;                      /* Pool the strand belongs to. */
+} up_strand_t;
+
+/* A cancellation token, see `up_pool_submit_token`. Tokens are linked in
+ * `pool->tokens` so that the ones of discarded tasks are freed too. */
+struct up_token {
+    int cancelled;                        /* If set the queued tasks are skipped. */
+    size_t refs;                          /* The owner and the queued tasks. */
+    void (*cleanup) (void *);             /* Called with the arg of skipped tasks. */
+    up_pool_t *pool;                      /* Pool the token belongs to. */
+    struct up_token *prev, *next;         /* Neighbours in `pool->tokens`. */
+};
+
+/* Token, routine and arg of a task with a token, in the `data` of the task. */
+typedef struct up_token_entry {
+    up_token_t *token;
+    void (*task_routine) (void *);
+    void *arg;
+} up_token_entry_t;
+
+/* A block of a worker's arena, its data follows the header. */
+typedef struct up_arena_block {
+    struct up_arena_block *prev;          /* Block allocated before. */
+    size_t size;                          /* Size of the data. */
+} up_arena_block_t;
+
+#define UP_ARENA_HEADER \
+    ((sizeof(up_arena_block_t) + UP_ARENA_ALIGN - 1) & ~((size_t) UP_ARENA_ALIGN - 1))
+
+/* A worker's bump pointer arena of scratch memory. */
+struct up_arena {
+    up_arena_block_t *block;              /* Block allocations are carved from. */
+    size_t used;                          /* Bytes of `block` allocated. */
+    up_arena_block_t *spare;              /* Largest block released, to be reused. */
+};
+
+/* A worker thread of the pool. */
+typedef struct up_worker {
+    up_deque_t deque;                     /* Tasks submitted by this worker. */
+    up_pool_t *pool;                      /* Pool the worker belongs to. */
+    size_t index;                         /* Index in `pool->workers`. */
+    size_t domain;                        /* Index of the worker's node. */
+    int state;                            /* State of the worker's thread. */
+    unsigned int seed;                    /* Seed to pick steal victims. */
+    size_t lane_next;                     /* Producers' lane to poll first. */
+    up_fiber_t *fiber;                    /* Fiber running on the worker, or NULL. */
+    ucontext_t *back;                     /* Context `fiber` switches back to. */
+    up_fiber_t *ready, *ready_tail;       /* Yielded fibers, in order. */
+    up_fiber_t *free_fibers;              /* Finished fibers, to be reused. */
+    up_arena_t arena;                     /* Scratch memory of the running task. */
+    int hooked;                           /* If set `pool->on_start` was called. */
+    int skipped;                          /* If set the task run was cancelled. */
+    up_stats_t stats up_cache_aligned;    /* Statistics, written by the worker only. */
+} up_worker_t;
+
+/* A delayed or periodic task, linked in a slot of the timer wheel. */
+struct up_timer {
+    void (*task_routine) (void *);        /* Pointer to the routine to execute. */
+    void *arg;                            /* Pointer to the arg of the routine. */
+    unsigned long expires;                /* Tick the timer expires at. */
+    unsigned long period;                 /* Ticks between runs, 0 to run once. */
+    int level;                            /* Level of the wheel it's linked in. */
+    struct up_timer **slot;               /* Head of the list it's linked in. */
+    struct up_timer *prev, *next;         /* Neighbours in the list. */
+    up_pool_t *pool;                      /* Pool the timer belongs to. */
+};
+
+/* A hierarchical timer wheel, serviced by a thread of the pool.
+ *
+ * A timer expiring in less than 64^(l+1) ticks is linked in level `l`,
+ * the slots of levels above 0 are cascaded down when the ticks reach
+ * them, so adding, cancelling and expiring a timer costs O(1).
+ */
+typedef struct up_wheel {
+    pthread_mutex_t lock;                 /* Lock of the whole wheel. */
+    up_timer_t *slots[UP_WHEEL_LEVELS][UP_WHEEL_SLOTS]; /* Lists of timers. */
+    size_t counts[UP_WHEEL_LEVELS];       /* Timers linked in each level. */
+    unsigned long origin;                 /* Clock time of tick 0. */
+    unsigned long tick;                   /* Next tick to process. */
+    unsigned long wake_tick;              /* Tick the thread sleeps until. */
+    int seq;                              /* Futex word the thread sleeps on. */
+    int started;                          /* If set `thread` runs. */
+    pthread_t thread;                     /* Thread servicing the wheel. */
+    up_task_t *fired;                     /* Tasks of the expired timers. */
+    size_t fired_count, fired_size;       /* Length and size of `fired`. */
+} up_wheel_t;
+
+/* A task waiting for a file descriptor, see `up_pool_submit_on_fd`. */
+typedef struct up_fd_wait {
+    void (*task_routine) (void *);        /* Pointer to the routine to execute. */
+    void *arg;                            /* Pointer to the arg of the routine. */
+    int fd;                               /* File descriptor waited for. */
+    struct up_fd_wait *prev, *next;       /* Neighbours in `reactor->waits`. */
+} up_fd_wait_t;
+
+/* The pool's epoll instance, serviced by a thread of the pool. */
+typedef struct up_reactor {
+    pthread_mutex_t lock;                 /* Lock of `waits` and `started`. */
+    int epfd;                             /* The epoll instance. */
+    int wakefd;                           /* Eventfd waking `thread` at shutdown. */
+    int started;                          /* If set `thread` runs. */
+    pthread_t thread;                     /* Thread servicing `epfd`. */
+    up_fd_wait_t *waits;                  /* Registered waits. */
+} up_reactor_t;
+
+/* A registered producer's submission lane.
+ *
+ * Lanes are owned by the pool and recycled when their producer
+ * unregisters, so that workers can poll them without synchronizing with
+ * registrations. Tasks left in a lane are still taken by the workers.
+ */
+struct up_producer {
+    up_ring_t *ring;                      /* Tasks submitted by the producer. */
+    up_pool_t *pool;                      /* Pool the lane belongs to. */
+    int used;                             /* Set while a producer owns the lane. */
+};
+
+/* An edge of a task dependency graph, in the successors list of the
+ * task it depends on. */
+typedef struct up_edge {
+    struct up_task_handle *task;          /* Task depending on the list's owner. */
+    struct up_edge *next;                 /* Next successor of the list's owner. */
+} up_edge_t;
+
+/* A handle to a submitted task.
+ *
+ * Handles are owned by the pool and by the submitter, `refs` counts the
+ * owners. When both are done with it the handle returns to the pool's
+ * free list, they are never freed before the pool is destroyed.
+ */
+struct up_task_handle {
+    void *(*task_routine) (void *);       /* Pointer to the routine to execute. */
+    void *arg;                            /* Pointer to the arg of the routine. */
+    void *result;                         /* Value returned by the routine. */
+    int done;                             /* Futex word, set when completed. */
+    size_t waiters;                       /* Threads blocked waiting for `done`. */
+    size_t refs;                          /* Number of owners of the handle. */
+    size_t pending;                       /* Dependencies not completed yet. */
+    up_edge_t *succs;                     /* Successors, `UP_SUCCS_CLOSED` once done. */
+    up_edge_t *edges;                     /* Edges to the dependencies, one each. */
+    up_pool_t *pool;                      /* Pool the handle belongs to. */
+    struct up_task_handle *next;          /* Next handle of the free list. */
+};
+
+/* The successors list of a completed task, no more edges can be added. */
+static up_edge_t up_succs_closed;
+#define UP_SUCCS_CLOSED (&up_succs_closed)
+
+/* A runner of a parallel loop, it owns an accumulator of the loop. */
+typedef struct up_loop_runner {
+    struct up_loop *loop;                 /* Loop the runner belongs to. */
+    size_t index;                         /* Index of the runner's accumulator. */
+} up_loop_runner_t;
+
+/* A parallel loop over a range of indexes.
+ *
+ * The loop is owned by the caller and by every submitted runner, `refs`
+ * counts the owners and the last one frees it.
+ */
+typedef struct up_loop {
+    size_t next up_cache_aligned;         /* First index not claimed yet. */
+    size_t remaining up_cache_aligned;    /* Number of indexes not processed yet. */
+    size_t end up_cache_aligned;          /* End of the range. */
+    size_t grain;                         /* Minimum size of a chunk. */
+    size_t parts;                         /* Number of runners. */
+    void (*for_body) (void *, size_t, size_t);
+    void (*reduce_body) (void *, size_t, size_t, void *);
+    void *ctx;                            /* Context passed to the body. */
+    char *accs;                           /* Accumulators of the runners. */
+    size_t acc_stride;                    /* Distance between accumulators. */
+    int done;                             /* Futex word, set when completed. */
+    size_t waiters;                       /* Threads blocked waiting for `done`. */
+    size_t refs;                          /* Number of owners of the loop. */
+    up_loop_runner_t *runners;            /* Runners of the loop. */
+} up_loop_t;
+
+/* A block of task handles. */
+typedef struct up_handle_slab {
+    up_task_handle_t handles[UP_HANDLE_SLAB];
+    struct up_handle_slab *next;          /* Previously allocated slab. */
+} up_handle_slab_t;
+
 /* The thread pool. */
 struct up_pool {
-    size_t thread_count;                  /* Number of threads of the Pool. */
-    size_t enq_count, deq_count;          /* Enqueued/Dequeued task counters. */
+    size_t thread_count;                  /* Maximum number of threads of the Pool. */
+    size_t min_threads;                   /* Threads an elastic pool keeps running. */
+    size_t running;                       /* Number of running threads. */
+    size_t grow_depth;                    /* Queued tasks above which the pool grows. */
+    unsigned long grow_wait_ns;           /* Wait in queue above which it grows, or 0. */
+    int late;                             /* If set the last task waited that long. */
+    unsigned long idle_ns;                /* Idle time after which a worker retires. */
+    int affinity;                         /* Placement of the workers' threads. */
+    size_t stack_size;                    /* Stack size of the workers' threads. */
+    size_t guard_size;                    /* Guard size of the workers' stacks. */
+    int sched_policy;                     /* Policy of the workers' threads. */
+    int sched_priority;                   /* Priority of the workers' threads. */
+    char name[16];                        /* Prefix of the workers' names. */
+    int shutdown;                         /* Shutdown mode, 0 while running. */
+    int stopped;                          /* Futex word, set when no worker runs. */
+    pthread_mutex_t resize_lock;          /* Lock to start and join threads. */
     pthread_t *threads;                   /* Array of thread IDs. */
-    pthread_cond_t cond;                  /* Condition to signal threads for tasks. */
-    pthread_mutex_t enq_lock, deq_lock;   /* Task queue's locks. */
-    up_node_t *head, *tail;               /* Task queue's head, tail. */
+    up_worker_t *workers;                 /* Array of workers, one per thread. */
+    up_ring_t *ring;                      /* Bounded task queue, NULL if unbounded. */
+    up_domain_t *domains;                 /* NUMA nodes the workers are spread on. */
+    size_t domain_count;                  /* Number of `domains`. */
+    int *cpu_domain;                      /* Node of each CPU, NULL if unknown. */
+    int full_policy;                      /* What to do when `ring` is full. */
+    unsigned long spin_ns;                /* Time to spin before parking. */
+    int low_latency;                      /* If set consumers never park. */
+    int stats_enabled;                    /* If set tasks are timed. */
+    up_producer_t *lanes;                 /* Lanes of registered producers. */
+    size_t lane_count;                    /* Number of `lanes` ever registered. */
+    up_group_t *groups;                   /* Task groups. */
+    size_t group_count;                   /* Number of `groups` ever created. */
+    size_t group_next;                    /* Group being served. */
+    size_t group_queued;                  /* Tasks queued in the groups. */
+    pthread_mutex_t group_lock;           /* Lock of the groups' scheduling. */
+    up_strand_t *strands;                 /* Strands, NULL until a keyed task. */
+
+    /* Producers' side of the task queue. */
+    pthread_mutex_t enq_lock up_cache_aligned; /* Task queue's tail lock. */
+    up_node_t *tail;                      /* Task queue's tail. */
+    size_t enq_count;                     /* Enqueued task counter. */
+    size_t full_waiters;                  /* Producers blocked on a full `ring`. */
+    pthread_cond_t full_cond;             /* Condition to signal a freed `ring` slot. */
+
+    /* Consumers' side of the task queue. */
+    pthread_mutex_t deq_lock up_cache_aligned; /* Task queue's head lock. */
+    up_node_t *head;                      /* Task queue's head. */
+    size_t deq_count;                     /* Dequeued task counter. */
+
+    /* Written by both sides on every task. */
+    size_t idle up_cache_aligned;         /* Consumers parked waiting for tasks. */
+    int park_seq;                         /* Futex word consumers park on. */
+    size_t inflight up_cache_aligned;     /* Submitted tasks not yet completed. */
+    size_t quiescent_waiters;             /* Threads blocked in `up_pool_wait`. */
+    int quiescent_seq;                    /* Futex word `up_pool_wait` blocks on. */
+
+    up_level_t levels[UP_PRIO_LEVELS] up_cache_aligned; /* Queues of the priority levels. */
+    up_stats_t ext_stats;                 /* Statistics of threads out of the pool. */
+    pthread_mutex_t handle_lock;          /* Lock of the handles' free list. */
+    up_task_handle_t *free_handles;       /* Free list of task handles. */
+    up_handle_slab_t *handle_slabs;       /* Allocated slabs of task handles. */
+    up_wheel_t wheel;                     /* Timers of delayed and periodic tasks. */
+    up_reactor_t reactor;                 /* Tasks waiting for file descriptors. */
+    pthread_mutex_t fiber_lock;           /* Lock of `fibers`. */
+    up_fiber_t *fibers;                   /* Every fiber allocated. */
+    int hooks_set;                        /* If set the hooks below are set. */
+    void (*on_start) (void *, size_t);    /* Called by workers when started. */
+    void (*on_stop) (void *, size_t);     /* Called by workers when exiting. */
+    void *hook_ctx;                       /* Context passed to the hooks. */
+    pthread_mutex_t token_lock;           /* Lock of `tokens`. */
+    up_token_t *tokens;                   /* Tokens not freed yet. */
 };
 
 
-/* Enqueue a new task into the pool's queue.
+/* Return the time of `CLOCK_MONOTONIC` in nanoseconds. */
+static unsigned long up_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long) ts.tv_sec * 1000000000UL + (unsigned long) ts.tv_nsec;
+}
+
+/* Store in `ts` the absolute `CLOCK_REALTIME` time `ns` nanoseconds from now. */
+static void up_timespec_after(struct timespec *ts, unsigned long ns)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+
+    ts->tv_sec += ns / 1000000000UL;
+    ts->tv_nsec += ns % 1000000000UL;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+#ifdef __linux__
+
+/* Block while `*addr` equals `val`, or until woken up by `up_futex_wake`.
+ *
+ * If `abstime` is not NULL wait at most until the absolute `CLOCK_REALTIME`
+ * time `abstime` and then return `ETIMEDOUT`.
+ */
+static int up_futex_wait(int *addr, int val, const struct timespec *abstime)
+{
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+                val, abstime, NULL, FUTEX_BITSET_MATCH_ANY) != 0 && errno == ETIMEDOUT) {
+        return ETIMEDOUT;
+    }
+
+    return 0;
+}
+
+/* Wake up at most `n` threads blocked in `up_futex_wait` on `addr`. */
+static void up_futex_wake(int *addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#else
+
+/* Without futexes all the waiters share one condition and every wake up
+ * is a broadcast, waiters re-check their word and wait again. */
+static pthread_mutex_t up_futex_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t up_futex_cond = PTHREAD_COND_INITIALIZER;
+
+static void up_futex_cleanup(void *arg)
+{
+    pthread_mutex_unlock(&up_futex_lock);
+}
+
+static int up_futex_wait(int *addr, int val, const struct timespec *abstime)
+{
+    int retv = 0;
+
+    pthread_mutex_lock(&up_futex_lock);
+
+    pthread_cleanup_push(up_futex_cleanup, NULL);
+
+    if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val) {
+        if (abstime == NULL) {
+            pthread_cond_wait(&up_futex_cond, &up_futex_lock);
+        } else {
+            retv = pthread_cond_timedwait(&up_futex_cond, &up_futex_lock, abstime);
+        }
+    }
+
+    pthread_cleanup_pop(1);
+
+    return retv == ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+static void up_futex_wake(int *addr, int n)
+{
+    pthread_mutex_lock(&up_futex_lock);
+    pthread_cond_broadcast(&up_futex_cond);
+    pthread_mutex_unlock(&up_futex_lock);
+}
+
+#endif
+
+static void up_pool_grow(up_pool_t *pool);
+static int up_wheel_destroy(up_wheel_t *wheel);
+static int up_reactor_destroy(up_reactor_t *reactor);
+static void up_reactor_wake(up_reactor_t *reactor);
+
+/* Wake up `n` consumers parked waiting for tasks, if there are any.
+ *
+ * Consumers register in `pool->idle` and read `pool->park_seq` before
+ * they re-check for work and park, so bumping the sequence here ensures
+ * that a wake up is not lost. The fence orders the caller's update of a
+ * queue before the read of `pool->idle`. When nobody is parked this costs
+ * no system call, but an elastic pool may grow instead.
+ */
+static void up_pool_wake_n(up_pool_t *pool, size_t n)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (n == 0) {
+        return;
+    }
+
+    if (__atomic_load_n(&pool->idle, __ATOMIC_RELAXED) == 0) {
+        up_pool_grow(pool);
+        return;
+    }
+
+    __atomic_add_fetch(&pool->park_seq, 1, __ATOMIC_SEQ_CST);
+
+    up_futex_wake(&pool->park_seq, n > INT_MAX ? INT_MAX : (int) n);
+}
+
+/* Wake up one consumer parked waiting for tasks. */
+static void up_pool_wake(up_pool_t *pool)
+{
+    up_pool_wake_n(pool, 1);
+}
+
+/* Wake up one thread waiting on `cond` if `waiters` is non zero.
+ *
+ * Waiters increment their counter while holding `lock` and re-check before
+ * waiting, so taking `lock` here guarantees that the signal is not lost.
+ */
+static int up_pool_signal(size_t *waiters, pthread_mutex_t *lock, pthread_cond_t *cond)
+{
+    int retv;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0) {
+        return UP_SUCCESS;
+    }
+
+    retv = pthread_mutex_lock(lock);
+    if (retv != 0) {
+        up_handle_error_en("up_pool_signal:pthread_mutex_lock", retv, UP_ERROR_MUTEX_LOCK);
+    }
+
+    pthread_cond_signal(cond);
+
+    retv = pthread_mutex_unlock(lock);
+    if (retv != 0) {
+        up_handle_error_en("up_pool_signal:pthread_mutex_unlock", retv, UP_ERROR_MUTEX_LOCK);
+    }
+
+    return UP_SUCCESS;
+}
+
+/* Account for `n` submitted tasks that completed, or were never queued.
+ *
+ * The thread that brings `pool->inflight` to zero wakes up the threads
+ * blocked in `up_pool_wait`. They register in `pool->quiescent_waiters`
+ * before re-checking `pool->inflight`, so the wake up is not lost.
+ */
+static void up_pool_done_n(up_pool_t *pool, size_t n)
+{
+    if (__atomic_sub_fetch(&pool->inflight, n, __ATOMIC_SEQ_CST) != 0) {
+        return;
+    }
+
+    if (__atomic_load_n(&pool->quiescent_waiters, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_add_fetch(&pool->quiescent_seq, 1, __ATOMIC_SEQ_CST);
+        up_futex_wake(&pool->quiescent_seq, INT_MAX);
+    }
+
+    /* Draining workers parked waiting for the running tasks can exit. */
+    if (__atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST) != 0) {
+        __atomic_add_fetch(&pool->park_seq, 1, __ATOMIC_SEQ_CST);
+        up_futex_wake(&pool->park_seq, INT_MAX);
+    }
+}
+
+/* Return non zero if the workers of a shut down pool have to exit.
+ *
+ * While draining they exit once every submitted task has completed, no
+ * task can be submitted afterwards, see `up_pool_closed`.
+ */
+static int up_pool_stopping(up_pool_t *pool)
+{
+    int mode = __atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST);
+
+    return mode == UP_SHUTDOWN_DISCARD ||
+           (mode == UP_SHUTDOWN_DRAIN && __atomic_load_n(&pool->inflight, __ATOMIC_SEQ_CST) == 0);
+}
+
+/* Key of the `up_worker_t` of the calling thread, NULL outside a pool. */
+static pthread_key_t up_worker_key;
+static pthread_once_t up_worker_key_once = PTHREAD_ONCE_INIT;
+
+static void up_worker_key_create(void)
+{
+    pthread_key_create(&up_worker_key, NULL);
+}
+
+/* Return the worker of `pool` running the calling thread, or NULL. */
+static up_worker_t *up_pool_current_worker(up_pool_t *pool)
+{
+    up_worker_t *worker;
+
+    worker = (up_worker_t *) pthread_getspecific(up_worker_key);
+    if (worker == NULL || worker->pool != pool) {
+        return NULL;
+    }
+
+    return worker;
+}
+
+/* Return non zero if a shut down pool rejects the caller's tasks.
+ *
+ * The caller counts the task in `pool->inflight` before, so that either
+ * the task is rejected or draining workers wait for it to complete.
+ * While draining, tasks spawned by running tasks are still accepted.
+ */
+static int up_pool_closed(up_pool_t *pool)
+{
+    int mode = __atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST);
+
+    return mode == UP_SHUTDOWN_DISCARD ||
+           (mode == UP_SHUTDOWN_DRAIN && up_pool_current_worker(pool) == NULL);
+}
+
+/* Return the statistics the calling thread accounts to. Only its owner
+ * writes to a worker's slot, the others share `pool->ext_stats`. */
+static up_stats_t *up_pool_stats_slot(up_pool_t *pool)
+{
+    up_worker_t *worker = up_pool_current_worker(pool);
+
+    return worker != NULL ? &worker->stats : &pool->ext_stats;
+}
+
+/* Return the submit time of a new task, 0 if tasks are not timed. */
+static unsigned long up_pool_stamp(up_pool_t *pool)
+{
+    if (!__atomic_load_n(&pool->stats_enabled, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    return up_clock_ns();
+}
+
+/* Return the histogram bucket of a duration, its base 2 logarithm. */
+static size_t up_stats_bucket(unsigned long ns)
+{
+    size_t b;
+
+    b = ns > 1 ? (size_t) (sizeof(unsigned long) * CHAR_BIT - 1 - __builtin_clzl(ns)) : 0;
+
+    return b < UP_STATS_BUCKETS ? b : UP_STATS_BUCKETS - 1;
+}
+
+/* Lock `lock`, counting in `contended` the times it was already held. */
+static int up_mutex_lock(pthread_mutex_t *lock, unsigned long *contended)
+{
+    int retv;
+
+    retv = pthread_mutex_trylock(lock);
+    if (retv != EBUSY) {
+        return retv;
+    }
+
+    __atomic_add_fetch(contended, 1, __ATOMIC_RELAXED);
+
+    return pthread_mutex_lock(lock);
+}
+
+/* Free a chain of nodes. */
+static void up_nodes_free(up_node_t *node)
+{
+    up_node_t *t;
+
+    while (node != NULL) {
+        t = node;
+        node = node->next;
+        free(t);
+    }
+}
+
+/* Attach the chain of `n` nodes from `first` to `last` at the `pool->tail`.
+ *
+ * If `try` is set the `pool->enq_lock` is not waited for.
+ */
+static int up_pool_enq_chain(up_pool_t *pool, up_node_t *first, up_node_t *last,
+                             size_t n, int try)
+{
+    int retv;
+    unsigned long *contended = &up_pool_stats_slot(pool)->enq_contended;
+
+    if (try) {
+        retv = pthread_mutex_trylock(&pool->enq_lock);
+        if (retv == EBUSY) {
+            __atomic_add_fetch(contended, 1, __ATOMIC_RELAXED);
+            return UP_ERROR_MUTEX_BUSY;
+        }
+    } else {
+        retv = up_mutex_lock(&pool->enq_lock, contended);
+    }
+    if (retv != 0) {
+        up_handle_error_en("up_pool_enq:pthread_mutex_lock", retv, UP_ERROR_MUTEX_LOCK);
+    }
+
+    pool->tail->next = first;
+    pool->tail = last;
+
+    __atomic_add_fetch(&pool->enq_count, n, __ATOMIC_RELEASE);
+
+    retv = pthread_mutex_unlock(&pool->enq_lock);
+    if (retv != 0) {
+        up_handle_error("up_pool_enq:pthread_mutex_unlock", UP_ERROR_MUTEX_LOCK);
+    }
+
+    return UP_SUCCESS;
+}
+
+/* Enqueue a new task into the pool's queue.
+ *
+ * A new `up_node_t` is allocated, the `task` is copied into the
+ * new `node` and then the `node` is attached at the `pool->tail`
+ * of the task queue. Finally, if a consumer is parked it is woken
+ * up to consume the new task.
+ *
+ * If `try` is set the `pool->enq_lock` is not waited for.
+ */
+static int up_pool_enq(up_pool_t *pool, up_task_t *task, int try)
+{
+    int retv;
+    up_node_t *node;
+
+    node = (up_node_t *) malloc(sizeof(up_node_t));
+    if (node == NULL) {
+        up_handle_error("up_pool_enq:malloc", UP_ERROR_MALLOC);
+    }
+
+    memcpy((void *) &node->task, (const void *) task, sizeof(up_task_t));
+    node->next = NULL;
+
+    retv = up_pool_enq_chain(pool, node, node, 1, try);
+    if (retv != UP_SUCCESS) {
+        free(node);
+        return retv;
+    }
+
+    up_pool_wake(pool);
+
+    return UP_SUCCESS;
+}
+
+/* Enqueue `n` new tasks into the pool's queue.
+ *
+ * The nodes are allocated and linked before taking the `pool->enq_lock`,
+ * so the whole batch is attached in a single critical section. Then as
+ * many consumers as there are tasks, or parked consumers, are woken up.
+ */
+static int up_pool_enq_batch(up_pool_t *pool, void (*task_routines[]) (void *),
+                             void *args[], size_t n)
+{
+    int retv;
+    size_t i;
+    unsigned long stamp;
+    up_node_t *first, *last, *node;
+
+    if (n == 0) {
+        return UP_SUCCESS;
+    }
+
+    stamp = up_pool_stamp(pool);
+    first = last = NULL;
+
+    for (i = 0; i < n; i++) {
+        node = (up_node_t *) malloc(sizeof(up_node_t));
+        if (node == NULL) {
+            up_nodes_free(first);
+            up_handle_error("up_pool_enq_batch:malloc", UP_ERROR_MALLOC);
+        }
+
+        node->task.task_routine = task_routines[i];
+        node->task.arg = args[i];
+        node->task.stamp = stamp;
+        node->next = NULL;
+
+        if (last == NULL) {
+            first = node;
+        } else {
+            last->next = node;
+        }
+        last = node;
+    }
+
+    retv = up_pool_enq_chain(pool, first, last, n, 0);
+    if (retv != UP_SUCCESS) {
+        up_nodes_free(first);
+        return retv;
+    }
+
+    up_pool_wake_n(pool, n);
+
+    return UP_SUCCESS;
+}
+
+/* Initialize an empty deque. Return 0 on allocation failure. */
+static int up_deque_init(up_deque_t *deque)
+{
+    up_deque_array_t *a;
+
+    a = (up_deque_array_t *) malloc(sizeof(up_deque_array_t));
+    if (a == NULL) {
+        return 0;
+    }
+
+    a->tasks = (up_task_t *) malloc(UP_DEQUE_SIZE * sizeof(up_task_t));
+    if (a->tasks == NULL) {
+        free(a);
+        return 0;
+    }
+
+    a->mask = UP_DEQUE_SIZE - 1;
+    a->prev = NULL;
+
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->array = a;
+
+    return 1;
+}
+
+static void up_deque_destroy(up_deque_t *deque)
+{
+    up_deque_array_t *a, *t;
+
+    for (a = deque->array; a != NULL; ) {
+        t = a;
+        a = a->prev;
+        free(t->tasks);
+        free(t);
+    }
+}
+
+/* Push a task at the bottom of the deque. Called only by the owner.
+ *
+ * When the array is full its tasks between `top` and `bottom` are copied
+ * into a new array of double size.
+ */
+static int up_deque_push(up_deque_t *deque, const up_task_t *task)
+{
+    long i, top, bottom;
+    up_deque_array_t *a, *n;
+
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    a = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+    if (bottom - top > (long) a->mask) {
+        n = (up_deque_array_t *) malloc(sizeof(up_deque_array_t));
+        if (n == NULL) {
+            up_handle_error("up_deque_push:malloc", UP_ERROR_MALLOC);
+        }
+
+        n->mask = (a->mask << 1) | 1;
+        n->prev = a;
+
+        n->tasks = (up_task_t *) malloc((n->mask + 1) * sizeof(up_task_t));
+        if (n->tasks == NULL) {
+            free(n);
+            up_handle_error("up_deque_push:malloc", UP_ERROR_MALLOC);
+        }
+
+        for (i = top; i < bottom; i++) {
+            n->tasks[i & n->mask] = a->tasks[i & a->mask];
+        }
+
+        __atomic_store_n(&deque->array, n, __ATOMIC_RELEASE);
+        a = n;
+    }
+
+    a->tasks[bottom & a->mask] = *task;
+
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+
+    return UP_SUCCESS;
+}
+
+/* Take a task from the bottom of the deque. Called only by the owner.
+ *
+ * Return 0 if the deque is empty or the last task was stolen.
+ */
+static int up_deque_take(up_deque_t *deque, up_task_t *task)
+{
+    int taken;
+    long top, bottom;
+    up_deque_array_t *a;
+
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    a = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    *task = a->tasks[bottom & a->mask];
+
+    if (top < bottom) {
+        return 1;
+    }
+
+    /* Last task, race against thieves for it. */
+    taken = __atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+
+    return taken;
+}
+
+/* Steal a task from the top of the deque.
+ *
+ * Return 0 if the deque is empty or another thread won the task.
+ */
+static int up_deque_steal(up_deque_t *deque, up_task_t *task)
+{
+    long top, bottom;
+    up_deque_array_t *a;
+
+    top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom) {
+        return 0;
+    }
+
+    a = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+
+    *task = a->tasks[top & a->mask];
+
+    return __atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* Return the number of tasks in the deque. */
+static size_t up_deque_size(up_deque_t *deque)
+{
+    long top, bottom;
+
+    top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    return bottom > top ? (size_t) (bottom - top) : 0;
+}
+
+/* Try to steal a task from the deques of the other workers.
+ *
+ * Victims are visited once each, starting from a random one so that
+ * thieves spread over the pool.
+ */
+static int up_pool_steal(up_pool_t *pool, up_worker_t *worker, up_task_t *task)
+{
+    size_t i, v, start;
+
+    worker->seed = worker->seed * 1103515245 + 12345;
+    start = (worker->seed >> 16) % pool->thread_count;
+
+    for (i = 0; i < pool->thread_count; i++) {
+        v = (start + i) % pool->thread_count;
+
+        if (v != worker->index && up_deque_steal(&pool->workers[v].deque, task)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Return non zero if there is a task to steal in any deque. */
+static int up_pool_stealable(up_pool_t *pool)
+{
+    size_t i;
+
+    for (i = 0; i < pool->thread_count; i++) {
+        if (up_deque_size(&pool->workers[i].deque) > 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Dequeue a task from the pool's queue.
+ *
+ * The dequeued `pool->head->task` is copied to `task` and then the
+ * `pool->head` node is freed. `UP_DEQ_EMPTY` is returned if the queue
+ * is empty, in which case `pool->deq_lock` is not even taken.
+ */
+static int up_pool_deq(up_pool_t *pool, up_task_t *task)
+{
+    int retv;
+    up_node_t *old_head;
+
+    if (__atomic_load_n(&pool->enq_count, __ATOMIC_ACQUIRE) ==
+        __atomic_load_n(&pool->deq_count, __ATOMIC_ACQUIRE)) {
+        return UP_DEQ_EMPTY;
+    }
+
+    retv = up_mutex_lock(&pool->deq_lock, &up_pool_stats_slot(pool)->deq_contended);
+    if (retv != 0) {
+        up_handle_error("up_pool_deq:pthread_mutex_lock", UP_ERROR_MUTEX_LOCK);
+    }
+
+    if (pool->head->next == NULL) {
+        retv = pthread_mutex_unlock(&pool->deq_lock);
+        if (retv != 0) {
+            up_handle_error("up_pool_deq:pthread_mutex_unlock", UP_ERROR_MUTEX_LOCK);
+        }
+
+        return UP_DEQ_EMPTY;
+    }
+
+    __atomic_add_fetch(&pool->deq_count, 1, __ATOMIC_RELEASE);
+
+    old_head = pool->head;
+
+    pool->head = pool->head->next;
+
+    memcpy((void *) task, (const void *) &pool->head->task, sizeof(up_task_t));
+
+    memset((void *) &pool->head->task, 0, sizeof(up_task_t));
+
+    retv = pthread_mutex_unlock(&pool->deq_lock);
+    if (retv != 0) {
+        up_handle_error("up_pool_deq:pthread_mutex_unlock", UP_ERROR_MUTEX_LOCK);
+    }
+
+    free(old_head);
+
+    return UP_SUCCESS;
+}
+
+/* Allocate a ring of at least `capacity` cells.
+ *
+ * The capacity is rounded up to a power of two so that positions can be
+ * mapped to cells with `mask`. Cell `i` starts with sequence number `i`,
+ * meaning it is free for the producer of position `i`.
+ */
+static up_ring_t *up_ring_create(size_t capacity)
+{
+    size_t i, size;
+    void *mem;
+    up_ring_t *ring;
+
+    for (size = 2; size < capacity; size <<= 1) { }
+
+    if (posix_memalign(&mem, UP_CACHE_LINE, sizeof(up_ring_t)) != 0) {
+        return NULL;
+    }
+
+    ring = (up_ring_t *) mem;
+
+    if (posix_memalign(&mem, UP_CACHE_LINE, size * sizeof(up_cell_t)) != 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->cells = (up_cell_t *) mem;
+    ring->mask = size - 1;
+    ring->enq_pos = 0;
+    ring->deq_pos = 0;
+
+    for (i = 0; i < size; i++) {
+        ring->cells[i].seq = i;
+    }
+
+    return ring;
+}
+
+static void up_ring_destroy(up_ring_t *ring)
+{
+    free(ring->cells);
+    free(ring);
+}
+
+/* Try to push `task` into the `ring`. Return 0 if the ring is full. */
+static int up_ring_push(up_ring_t *ring, const up_task_t *task)
+{
+    long diff;
+    size_t pos, seq;
+    up_cell_t *cell;
+
+    pos = __atomic_load_n(&ring->enq_pos, __ATOMIC_RELAXED);
+
+    for ( ;; ) {
+        cell = &ring->cells[pos & ring->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (long) seq - (long) pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->enq_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&ring->enq_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy((void *) &cell->task, (const void *) task, sizeof(up_task_t));
+
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/* Try to pop a task from the `ring` into `task`. Return 0 if it's empty. */
+static int up_ring_pop(up_ring_t *ring, up_task_t *task)
+{
+    long diff;
+    size_t pos, seq;
+    up_cell_t *cell;
+
+    pos = __atomic_load_n(&ring->deq_pos, __ATOMIC_RELAXED);
+
+    for ( ;; ) {
+        cell = &ring->cells[pos & ring->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (long) seq - (long) (pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->deq_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&ring->deq_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy((void *) task, (const void *) &cell->task, sizeof(up_task_t));
+
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/* Return the number of tasks in the `ring`. */
+static size_t up_ring_size(up_ring_t *ring)
+{
+    size_t enq_pos, deq_pos;
+
+    deq_pos = __atomic_load_n(&ring->deq_pos, __ATOMIC_ACQUIRE);
+    enq_pos = __atomic_load_n(&ring->enq_pos, __ATOMIC_ACQUIRE);
+
+    return enq_pos > deq_pos ? enq_pos - deq_pos : 0;
+}
+
+/* Return the number of tasks in the pool's main queue and producers'
+ * lanes, without locking.
+ *
+ * A task is dequeued only once counted as enqueued, so reading
+ * `deq_count` first never yields more dequeued than enqueued tasks.
+ */
+static size_t up_pool_depth(up_pool_t *pool)
+{
+    size_t i, n, depth, enq_count, deq_count;
+    up_ring_t *ring;
+
+    if (pool->ring != NULL) {
+        depth = up_ring_size(pool->ring);
+    } else {
+        deq_count = __atomic_load_n(&pool->deq_count, __ATOMIC_ACQUIRE);
+        enq_count = __atomic_load_n(&pool->enq_count, __ATOMIC_ACQUIRE);
+
+        depth = enq_count - deq_count;
+    }
+
+    n = __atomic_load_n(&pool->lane_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; i++) {
+        ring = __atomic_load_n(&pool->lanes[i].ring, __ATOMIC_ACQUIRE);
+        if (ring != NULL) {
+            depth += up_ring_size(ring);
+        }
+    }
+
+    return depth;
+}
+
+/* Enqueue a new task into the pool's bounded queue.
+ *
+ * No memory is allocated, the `task` is copied into a free cell of
+ * `pool->ring`. If the ring is full and `block` is not set the task is
+ * rejected. Otherwise the producer waits on `pool->full_cond` until a
+ * consumer frees a cell, `abstime` (if not NULL) passes or the pool is
+ * shut down discarding its tasks.
+ */
+static int up_pool_ring_enq(up_pool_t *pool, up_task_t *task, int block,
+                            const struct timespec *abstime)
+{
+    int retv, timedout, closed;
+
+    if (!up_ring_push(pool->ring, task)) {
+        if (!block) {
+            return UP_ERROR_QUEUE_FULL;
+        }
+
+        retv = pthread_mutex_lock(&pool->enq_lock);
+        if (retv != 0) {
+            up_handle_error_en("up_pool_ring_enq:pthread_mutex_lock", retv, UP_ERROR_MUTEX_LOCK);
+        }
+
+        __atomic_add_fetch(&pool->full_waiters, 1, __ATOMIC_SEQ_CST);
+
+        timedout = closed = 0;
+        while (!up_ring_push(pool->ring, task)) {
+            if (__atomic_load_n(&pool->shutdown, __ATOMIC_RELAXED) == UP_SHUTDOWN_DISCARD) {
+                closed = 1;
+                break;
+            }
+
+            if (abstime == NULL) {
+                pthread_cond_wait(&pool->full_cond, &pool->enq_lock);
+            } else if (pthread_cond_timedwait(&pool->full_cond, &pool->enq_lock,
+                                              abstime) == ETIMEDOUT) {
+                timedout = !up_ring_push(pool->ring, task);
+                break;
+            }
+        }
+
+        __atomic_sub_fetch(&pool->full_waiters, 1, __ATOMIC_SEQ_CST);
+
+        retv = pthread_mutex_unlock(&pool->enq_lock);
+        if (retv != 0) {
+            up_handle_error_en("up_pool_ring_enq:pthread_mutex_unlock", retv, UP_ERROR_MUTEX_LOCK);
+        }
+
+        if (timedout) {
+            return UP_ERROR_TIMEDOUT;
+        }
+
+        if (closed) {
+            return UP_ERROR_SHUTDOWN;
+        }
+    }
+
+    __atomic_add_fetch(&pool->enq_count, 1, __ATOMIC_RELAXED);
+
+    up_pool_wake(pool);
+
+    return UP_SUCCESS;
+}
+
+/* Dequeue a task from the pool's bounded queue.
+ *
+ * `UP_DEQ_EMPTY` is returned if the ring is empty. Otherwise a producer
+ * blocked on the full ring, if any, is signaled.
+ */
+static int up_pool_ring_deq(up_pool_t *pool, up_task_t *task)
+{
+    if (!up_ring_pop(pool->ring, task)) {
+        return UP_DEQ_EMPTY;
+    }
+
+    __atomic_add_fetch(&pool->deq_count, 1, __ATOMIC_RELAXED);
+
+    return up_pool_signal(&pool->full_waiters, &pool->enq_lock, &pool->full_cond);
+}
+
+/* Initialize an empty single lock queue. */
+static void up_queue_init(up_queue_t *queue)
+{
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->size = 0;
+}
+
+/* Destroy a single lock queue and free the tasks left in it. */
+static int up_queue_destroy(up_queue_t *queue)
+{
+    int retv;
+
+    retv = pthread_mutex_destroy(&queue->lock);
+    if (retv != 0) {
+        up_handle_error("up_queue_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    }
+
+    up_nodes_free(queue->head);
+
+    return UP_SUCCESS;
+}
+
+/* Enqueue a new task into a single lock queue. */
+static int up_queue_enq(up_queue_t *queue, up_task_t *task)
+{
+    int retv;
+    up_node_t *node;
+
+    node = (up_node_t *) malloc(sizeof(up_node_t));
+    if (node == NULL) {
+        up_handle_error("up_queue_enq:malloc", UP_ERROR_MALLOC);
+    }
+
+    memcpy((void *) &node->task, (const void *) task, sizeof(up_task_t));
+    node->next = NULL;
+
+    retv = pthread_mutex_lock(&queue->lock);
+    if (retv != 0) {
+        free(node);
+        up_handle_error_en("up_queue_enq:pthread_mutex_lock", retv, UP_ERROR_MUTEX_LOCK);
+    }
+
+    if (queue->tail == NULL) {
+        queue->head = node;
+    } else {
+        queue->tail->next = node;
+    }
+    queue->tail = node;
+
+    __atomic_add_fetch(&queue->size, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return UP_SUCCESS;
+}
+
+/* Dequeue a task from a single lock queue.
+ *
+ * `UP_DEQ_EMPTY` is returned if the queue is empty, in which case the
+ * `queue->lock` is not even taken.
+ */
+static int up_queue_deq(up_queue_t *queue, up_task_t *task)
+{
+    int retv;
+    up_node_t *node;
+
+    if (__atomic_load_n(&queue->size, __ATOMIC_ACQUIRE) == 0) {
+        return UP_DEQ_EMPTY;
+    }
+
+    retv = pthread_mutex_lock(&queue->lock);
+    if (retv != 0) {
+        up_handle_error_en("up_queue_deq:pthread_mutex_lock", retv, UP_ERROR_MUTEX_LOCK);
+    }
+
+    node = queue->head;
+    if (node != NULL) {
+        queue->head = node->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+
+        __atomic_sub_fetch(&queue->size, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    if (node == NULL) {
+        return UP_DEQ_EMPTY;
+    }
+
+    memcpy((void *) task, (const void *) &node->task, sizeof(up_task_t));
+
+    free(node);
+
+    return UP_SUCCESS;
+}
+
+/* Return non zero if the queue of priority level `prio` has tasks.
+ *
+ * For `UP_PRIO_NORMAL` only the pool's main queue is looked at, tasks in
+ * the deques are already served ahead of it.
+ */
+static int up_pool_level_pending(up_pool_t *pool, int prio)
+{
+    if (prio != UP_PRIO_NORMAL) {
+        return __atomic_load_n(&pool->levels[prio].queue.size, __ATOMIC_RELAXED) > 0;
+    }
+
+    if (pool->ring != NULL) {
+        return up_ring_size(pool->ring) > 0;
+    }
+
+    return __atomic_load_n(&pool->enq_count, __ATOMIC_RELAXED) !=
+           __atomic_load_n(&pool->deq_count, __ATOMIC_RELAXED);
+}
+
+/* Dequeue a task from the queue of a node other than the worker's. */
+static int up_pool_domain_steal(up_pool_t *pool, up_worker_t *worker, up_task_t *task)
+{
+    size_t i;
+
+    for (i = 0; i < pool->domain_count; i++) {
+        if (i != worker->domain && up_queue_deq(&pool->domains[i].queue, task) == UP_SUCCESS) {
+            return UP_SUCCESS;
+        }
+    }
+
+    return UP_DEQ_EMPTY;
+}
+
+/* Return non zero if there may be a task for a consumer to take. */
+static int up_pool_has_work(up_pool_t *pool)
+{
+    size_t i;
+
+    for (i = 0; i < pool->domain_count; i++) {
+        if (__atomic_load_n(&pool->domains[i].queue.size, __ATOMIC_ACQUIRE) > 0) {
+            return 1;
+        }
+    }
+
+    if (__atomic_load_n(&pool->levels[UP_PRIO_HIGH].queue.size, __ATOMIC_ACQUIRE) > 0 ||
+        __atomic_load_n(&pool->levels[UP_PRIO_LOW].queue.size, __ATOMIC_ACQUIRE) > 0) {
+        return 1;
+    }
+
+    if (up_pool_depth(pool) > 0 ||
+        __atomic_load_n(&pool->group_queued, __ATOMIC_ACQUIRE) > 0) {
+        return 1;
+    }
+
+    return up_pool_stealable(pool);
+}
+
+/* Take a task from the producers' lanes for `worker`, return 0 if they
+ * are empty. The lanes are polled round robin, starting after the last
+ * one a task was taken from, so that no producer is starved. */
+static int up_pool_lane_take(up_pool_t *pool, up_worker_t *worker, up_task_t *task)
+{
+    size_t i, n, lane;
+    up_ring_t *ring;
+
+    n = __atomic_load_n(&pool->lane_count, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < n; i++) {
+        lane = (worker->lane_next + i) % n;
+
+        ring = __atomic_load_n(&pool->lanes[lane].ring, __ATOMIC_ACQUIRE);
+        if (ring != NULL && up_ring_pop(ring, task)) {
+            worker->lane_next = lane + 1;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Take a task from the groups by deficit round robin, return 0 if they
+ * are empty.
+ *
+ * The group at `pool->group_next` is served until its deficit runs out
+ * or it is empty, then the next one has its deficit refilled with its
+ * weight. Every task costs one, so while queued a group gets a share of
+ * the tasks taken from the groups in proportion to its weight, and an
+ * empty group saves no credit for later.
+ *
+ * Only the pick is done under `pool->group_lock`, the task is dequeued
+ * after it, so workers serialize on a few loads and stores. If another
+ * worker took the group's last task meanwhile, the pick is done again.
+ */
+static int up_pool_group_take(up_pool_t *pool, up_task_t *task)
+{
+    size_t i, n;
+    up_group_t *group;
+
+    while (__atomic_load_n(&pool->group_queued, __ATOMIC_ACQUIRE) > 0) {
+        pthread_mutex_lock(&pool->group_lock);
+
+        n = pool->group_count;
+
+        for (i = 0; i <= n; i++) {
+            group = &pool->groups[pool->group_next];
+
+            if (group->deficit > 0 &&
+                __atomic_load_n(&group->queue.size, __ATOMIC_ACQUIRE) > 0) {
+                group->deficit--;
+                break;
+            }
+
+            pool->group_next = (pool->group_next + 1) % n;
+            pool->groups[pool->group_next].deficit = pool->groups[pool->group_next].weight;
+        }
+
+        pthread_mutex_unlock(&pool->group_lock);
+
+        /* Counted tasks not queued yet. */
+        if (i > n) {
+            return 0;
+        }
+
+        if (up_queue_deq(&group->queue, task) == UP_SUCCESS) {
+            __atomic_sub_fetch(&pool->group_queued, 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Take a task of priority level `prio` for `worker` without blocking.
+ *
+ * `UP_PRIO_NORMAL` tasks are first taken from the worker's own deque,
+ * then stolen from the other workers' deques, then dequeued from the
+ * queue of the worker's node, the producers' lanes, the groups, the
+ * pool's queue and lastly the queues of the other nodes.
+ */
+static int up_pool_take_level(up_pool_t *pool, up_worker_t *worker, int prio,
+                              up_task_t *task)
+{
+    int retv;
+
+    if (prio != UP_PRIO_NORMAL) {
+        return up_queue_deq(&pool->levels[prio].queue, task);
+    }
+
+    if (up_deque_take(&worker->deque, task) || up_pool_steal(pool, worker, task) ||
+        up_queue_deq(&pool->domains[worker->domain].queue, task) == UP_SUCCESS ||
+        up_pool_lane_take(pool, worker, task) || up_pool_group_take(pool, task)) {
+        return UP_SUCCESS;
+    }
+
+    if (pool->ring != NULL) {
+        retv = up_pool_ring_deq(pool, task);
+    } else {
+        retv = up_pool_deq(pool, task);
+    }
+
+    if (retv != UP_DEQ_EMPTY) {
+        return retv;
+    }
+
+    return up_pool_domain_steal(pool, worker, task);
+}
+
+/* Take a task for `worker` without blocking.
+ *
+ * Tasks are taken from the highest non-empty priority level. Every task
+ * taken ages the non-empty lower levels, a level aged `UP_PRIO_AGING`
+ * times is served first once so that it doesn't starve.
+ */
+static int up_pool_take(up_pool_t *pool, up_worker_t *worker, up_task_t *task)
+{
+    int retv, prio, lower;
+
+    for (prio = UP_PRIO_LOW; prio < UP_PRIO_HIGH; prio++) {
+        if (__atomic_load_n(&pool->levels[prio].age, __ATOMIC_RELAXED) >= UP_PRIO_AGING) {
+            __atomic_store_n(&pool->levels[prio].age, 0, __ATOMIC_RELAXED);
+
+            if (up_pool_take_level(pool, worker, prio, task) == UP_SUCCESS) {
+                return UP_SUCCESS;
+            }
+        }
+    }
+
+    for (prio = UP_PRIO_HIGH; prio >= UP_PRIO_LOW; prio--) {
+        retv = up_pool_take_level(pool, worker, prio, task);
+        if (retv != UP_DEQ_EMPTY) {
+            if (retv != UP_SUCCESS) {
+                return retv;
+            }
+
+            for (lower = UP_PRIO_LOW; lower < prio; lower++) {
+                if (up_pool_level_pending(pool, lower)) {
+                    __atomic_add_fetch(&pool->levels[lower].age, 1, __ATOMIC_RELAXED);
+                }
+            }
+
+            return UP_SUCCESS;
+        }
+    }
+
+    return UP_DEQ_EMPTY;
+}
+
+/* Call the routine of a task. */
+static void up_task_run(up_task_t *task)
+{
+    task->task_routine(task->arg == UP_INLINE_ARG ? (void *) task->data.bytes : task->arg);
+}
+
+/* Allocate `size` bytes from the arena. */
+void *up_arena_alloc(up_arena_t *arena, size_t size)
+{
+    size_t want;
+    up_arena_block_t *block = arena->block;
+
+    size = (size + UP_ARENA_ALIGN - 1) & ~((size_t) UP_ARENA_ALIGN - 1);
+
+    if (block == NULL || block->size - arena->used < size) {
+        if (arena->spare != NULL && arena->spare->size >= size) {
+            block = arena->spare;
+            arena->spare = NULL;
+        } else {
+            want = block != NULL ? block->size * 2 : UP_ARENA_BLOCK;
+            if (want < size) {
+                want = size;
+            }
+
+            block = (up_arena_block_t *) malloc(UP_ARENA_HEADER + want);
+            if (block == NULL) {
+                return NULL;
+            }
+
+            block->size = want;
+        }
+
+        block->prev = arena->block;
+        arena->block = block;
+        arena->used = 0;
+    }
+
+    arena->used += size;
+
+    return (char *) block + UP_ARENA_HEADER + arena->used - size;
+}
+
+/* Release what was allocated from the arena since it had `used` bytes of
+ * `block` allocated.
+ *
+ * The blocks added since are dropped, the largest one is kept as the
+ * spare so that tasks needing as much scratch memory don't allocate.
+ */
+static void up_arena_release(up_arena_t *arena, up_arena_block_t *block, size_t used)
+{
+    up_arena_block_t *b;
+
+    while (arena->block != block) {
+        b = arena->block;
+        arena->block = b->prev;
+
+        if (arena->spare == NULL || arena->spare->size < b->size) {
+            free(arena->spare);
+            arena->spare = b;
+        } else {
+            free(b);
+        }
+    }
+
+    arena->used = used;
+}
+
+/* Execute a taken task and account for its completion.
+ *
+ * Timed tasks also account for their time in queue and run time. What
+ * the task allocated from the worker's arena is released, only that, so
+ * tasks executed by a task waiting for another one don't release the
+ * memory of the waiting task. A fiber waiting that way is hidden from
+ * the task, which could otherwise park it with its own frames on top.
+ */
+static void up_pool_execute(up_pool_t *pool, up_worker_t *worker, up_task_t *task)
+{
+    int late;
+    unsigned long start, end, wait;
+    up_stats_t *stats = &worker->stats;
+    up_arena_block_t *block = worker->arena.block;
+    size_t used = worker->arena.used;
+    up_fiber_t *fiber = worker->fiber;
+
+    worker->fiber = NULL;
+
+    if (task->stamp != 0) {
+        start = up_clock_ns();
+        up_task_run(task);
+        end = up_clock_ns();
+
+        up_stat_add(stats->wait_hist[up_stats_bucket(start - task->stamp)], 1);
+        up_stat_add(stats->run_hist[up_stats_bucket(end - start)], 1);
+        up_stat_add(stats->busy_ns, end - start);
+
+        /* Written on changes only, read by producers to grow the pool. */
+        wait = __atomic_load_n(&pool->grow_wait_ns, __ATOMIC_RELAXED);
+        late = wait != 0 && start - task->stamp >= wait;
+        if (late != __atomic_load_n(&pool->late, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&pool->late, late, __ATOMIC_RELAXED);
+        }
+    } else {
+        up_task_run(task);
+    }
+
+    worker->fiber = fiber;
+
+    /* Cancelled tasks are counted in `cancelled` only. */
+    if (worker->skipped) {
+        worker->skipped = 0;
+    } else {
+        up_stat_add(stats->executed, 1);
+    }
+
+    up_arena_release(&worker->arena, block, used);
+
+    up_pool_done_n(pool, 1);
+}
+
+/* Let the calling worker retire if more than `pool->min_threads` run.
+ *
+ * The running count is decremented before re-checking for work, so a
+ * task submitted meanwhile either is seen here or finds the worker gone
+ * and wakes up, or grows, another one.
+ */
+static int up_pool_shrink(up_pool_t *pool)
+{
+    size_t running;
+
+    running = __atomic_load_n(&pool->running, __ATOMIC_RELAXED);
+    do {
+        if (running <= pool->min_threads) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&pool->running, &running, running - 1, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    if (up_pool_has_work(pool)) {
+        __atomic_add_fetch(&pool->running, 1, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Wait until there may be a task to take.
+ *
+ * The worker first spins for `pool->spin_ns`, then registers itself in
+ * `pool->idle` and parks on the `pool->park_seq` futex, see
+ * `up_pool_wake_n`. In low latency mode the worker never parks.
+ *
+ * It also returns once the pool is shut down, see `up_pool_stopping`.
+ * Workers of an elastic pool park at most `pool->idle_ns`, then non zero
+ * is returned if the worker should retire.
+ */
+static int up_pool_idle(up_pool_t *pool, up_worker_t *worker)
+{
+    int seq, timedout;
+    unsigned long i, start, deadline;
+    struct timespec abstime;
+
+    start = up_clock_ns();
+    deadline = start + __atomic_load_n(&pool->spin_ns, __ATOMIC_RELAXED);
+
+    for (i = 1; !up_pool_has_work(pool) && !up_pool_stopping(pool); i++) {
+        up_cpu_relax();
+
+        if (i % 1024 != 0) {
+            continue;
+        }
+
+        if (!__atomic_load_n(&pool->low_latency, __ATOMIC_RELAXED) &&
+            up_clock_ns() >= deadline) {
+            __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+
+            seq = __atomic_load_n(&pool->park_seq, __ATOMIC_SEQ_CST);
+
+            timedout = 0;
+            if (!up_pool_has_work(pool) && !up_pool_stopping(pool)) {
+                if (pool->min_threads < pool->thread_count) {
+                    up_timespec_after(&abstime,
+                                      __atomic_load_n(&pool->idle_ns, __ATOMIC_RELAXED));
+                    timedout = up_futex_wait(&pool->park_seq, seq, &abstime) == ETIMEDOUT;
+                } else {
+                    up_futex_wait(&pool->park_seq, seq, NULL);
+                }
+            }
+
+            __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+
+            up_stat_add(worker->stats.idle_ns, up_clock_ns() - start);
+
+            return timedout && up_pool_shrink(pool);
+        }
+    }
+
+    up_stat_add(worker->stats.idle_ns, up_clock_ns() - start);
+
+    return 0;
+}
+
+/* Return the worker running the calling thread, of any pool, or NULL. */
+static up_worker_t *up_worker_self(void)
+{
+    return (up_worker_t *) pthread_getspecific(up_worker_key);
+}
+
+/* Run the tasks given to the calling fiber, one after the other.
+ *
+ * The fiber's context is made once, a finished fiber switches back and
+ * is resumed with its next task from here. Fibers may move to another
+ * worker whenever they switch out, so the worker is looked up again.
+ */
+static void up_fiber_main(void)
+{
+    up_fiber_t *fiber;
+
+    for ( ;; ) {
+        fiber = up_worker_self()->fiber;
+
+        up_task_run(&fiber->task);
+
+        fiber->state = UP_FIBER_DONE;
+        swapcontext(&fiber->ctx, up_worker_self()->back);
+    }
+}
+
+/* Take a fiber from the worker's free list, allocating a new one when
+ * the list is empty. Fibers are freed with the pool. */
+static up_fiber_t *up_fiber_alloc(up_worker_t *worker)
+{
+    up_fiber_t *fiber;
+    up_pool_t *pool = worker->pool;
+
+    fiber = worker->free_fibers;
+    if (fiber != NULL) {
+        worker->free_fibers = fiber->next;
+        return fiber;
+    }
+
+    fiber = (up_fiber_t *) malloc(sizeof(up_fiber_t));
+    if (fiber == NULL) {
+        return NULL;
+    }
+
+    fiber->stack = (char *) malloc(UP_FIBER_STACK);
+    if (fiber->stack == NULL || getcontext(&fiber->ctx) != 0) {
+        free(fiber->stack);
+        free(fiber);
+        return NULL;
+    }
+
+    fiber->ctx.uc_stack.ss_sp = fiber->stack;
+    fiber->ctx.uc_stack.ss_size = UP_FIBER_STACK;
+    fiber->ctx.uc_link = NULL;
+    makecontext(&fiber->ctx, up_fiber_main, 0);
+
+    fiber->pool = pool;
+
+    pthread_mutex_lock(&pool->fiber_lock);
+    fiber->all = pool->fibers;
+    pool->fibers = fiber;
+    pthread_mutex_unlock(&pool->fiber_lock);
+
+    return fiber;
+}
+
+/* Queue a switched out fiber to the worker's ready list. */
+static void up_fiber_ready(up_worker_t *worker, up_fiber_t *fiber)
+{
+    fiber->next = NULL;
+
+    if (worker->ready_tail != NULL) {
+        worker->ready_tail->next = fiber;
+    } else {
+        worker->ready = fiber;
+    }
+    worker->ready_tail = fiber;
+}
+
+static void *up_fiber_wake(void *arg);
+
+/* Switch the calling worker to `fiber` until it finishes or switches out.
+ *
+ * The worker's context is saved on the caller's stack, so a worker
+ * executing tasks while waiting, from a fiber too, can switch to others.
+ * A fiber switched out stays counted in `pool->inflight`, one more time
+ * since the running task is completed by the caller, until resumed: a
+ * yielded one from the worker's ready list, a suspended one by a task
+ * depending on the awaited handle.
+ */
+static void up_fiber_switch(up_worker_t *worker, up_fiber_t *fiber)
+{
+    ucontext_t back, *prev_back = worker->back;
+    up_fiber_t *prev = worker->fiber;
+    up_pool_t *pool = worker->pool;
+
+    fiber->state = UP_FIBER_RUNNING;
+
+    worker->fiber = fiber;
+    worker->back = &back;
+
+    swapcontext(&back, &fiber->ctx);
+
+    worker->fiber = prev;
+    worker->back = prev_back;
+
+    if (fiber->state == UP_FIBER_DONE) {
+        fiber->next = worker->free_fibers;
+        worker->free_fibers = fiber;
+        return;
+    }
+
+    __atomic_add_fetch(&pool->inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (fiber->state == UP_FIBER_SUSPENDED &&
+        up_pool_submit_after(pool, &fiber->awaited, 1, up_fiber_wake, (void *) fiber,
+                             NULL) == UP_SUCCESS) {
+        return;
+    }
+
+    up_fiber_ready(worker, fiber);
+}
+
+/* Resume the first fiber of the worker's ready list, if any, and return
+ * non zero if one was resumed. */
+static int up_pool_run_ready(up_pool_t *pool, up_worker_t *worker)
+{
+    up_fiber_t *fiber = worker->ready;
+    up_arena_block_t *block = worker->arena.block;
+    size_t used = worker->arena.used;
+
+    if (fiber == NULL) {
+        return 0;
+    }
+
+    worker->ready = fiber->next;
+    if (worker->ready == NULL) {
+        worker->ready_tail = NULL;
+    }
+
+    up_fiber_switch(worker, fiber);
+
+    up_arena_release(&worker->arena, block, used);
+
+    up_pool_done_n(pool, 1);
+
+    return 1;
+}
+
+/* Resume a fiber on the worker executing this task. */
+static void up_fiber_resume(void *arg)
+{
+    up_fiber_switch(up_worker_self(), (up_fiber_t *) arg);
+}
+
+/* Submit the resumption of a fiber whose awaited handle has completed. */
+static void *up_fiber_wake(void *arg)
+{
+    up_fiber_t *fiber = (up_fiber_t *) arg;
+
+    if (up_pool_submit(fiber->pool, up_fiber_resume, arg) == UP_SUCCESS) {
+        up_pool_done_n(fiber->pool, 1);
+    }
+
+    return NULL;
+}
+
+/* Start the fiber task whose routine and arg are in `data`.
+ *
+ * Out of a worker, as run by a producer on a full bounded queue, or if
+ * no fiber can be allocated, the routine runs on the caller's stack.
+ */
+static void up_fiber_launch(void *data)
+{
+    up_fiber_t *fiber;
+    up_fiber_entry_t entry;
+    up_worker_t *worker = up_worker_self();
+
+    memcpy(&entry, data, sizeof(up_fiber_entry_t));
+
+    fiber = worker != NULL ? up_fiber_alloc(worker) : NULL;
+    if (fiber == NULL) {
+        entry.task_routine(entry.arg);
+        return;
+    }
+
+    fiber->task.task_routine = entry.task_routine;
+    fiber->task.arg = entry.arg;
+
+    up_fiber_switch(worker, fiber);
+}
+
+/* Switch the running fiber out to the worker. */
+static void up_fiber_park(up_worker_t *worker, int state)
+{
+    up_fiber_t *fiber = worker->fiber;
+
+    fiber->state = state;
+    swapcontext(&fiber->ctx, worker->back);
+}
+
+/* Let the other tasks of the worker run before going on. */
+int up_task_yield(void)
+{
+    up_worker_t *worker = up_worker_self();
+
+    if (worker == NULL || worker->fiber == NULL) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    up_fiber_park(worker, UP_FIBER_YIELDED);
+
+    return UP_SUCCESS;
+}
+
+/* Return the context of the worker running the calling thread. */
+int up_pool_worker_ctx(up_worker_ctx_t *ctx)
+{
+    up_worker_t *worker = up_worker_self();
+
+    if (worker == NULL) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    ctx->index = worker->index;
+    ctx->arena = &worker->arena;
+
+    return UP_SUCCESS;
+}
+
+/* Call the stop hook of an exiting worker, if it called the start one. */
+static void up_pool_worker_stop(up_pool_t *pool, up_worker_t *worker)
+{
+    if (!worker->hooked) {
+        return;
+    }
+
+    worker->hooked = 0;
+
+    if (pool->on_stop != NULL) {
+        pool->on_stop(pool->hook_ctx, worker->index);
+    }
+}
+
+/* Take a task from the pool and execute it.
+ *
+ * This function waits in `up_pool_idle` while there is no task to take.
+ * When a task is taken the task's routine is executed, then a yielded
+ * fiber is resumed, if any. The start hook is called before the first
+ * task once set, and the stop hook when the worker exits.
+ *
+ * Workers exit when the pool is shut down, see `up_pool_stopping`, or
+ * when they retire from an elastic pool. The last one to exit sets
+ * `pool->stopped`.
+ */
+static void *up_pool_worker(void *arg)
+{
+    int retv;
+    up_worker_t *worker = (up_worker_t *) arg;
+    up_pool_t *pool = worker->pool;
+
+    pthread_setspecific(up_worker_key, worker);
+
+    for ( ;; ) {
+        up_task_t task;
+
+        if (!worker->hooked && __atomic_load_n(&pool->hooks_set, __ATOMIC_ACQUIRE)) {
+            worker->hooked = 1;
+
+            if (pool->on_start != NULL) {
+                pool->on_start(pool->hook_ctx, worker->index);
+            }
+        }
+
+        if (__atomic_load_n(&pool->shutdown, __ATOMIC_RELAXED) == UP_SHUTDOWN_DISCARD) {
+            break;
+        }
+
+        retv = up_pool_take(pool, worker, &task);
+        if (retv == UP_DEQ_EMPTY) {
+            if (up_pool_run_ready(pool, worker)) {
+                continue;
+            }
+            if (up_pool_stopping(pool)) {
+                break;
+            }
+            if (up_pool_idle(pool, worker)) {
+                up_pool_worker_stop(pool, worker);
+                __atomic_store_n(&worker->state, UP_WORKER_EXITED, __ATOMIC_RELEASE);
+                return NULL;
+            }
+            continue;
+        }
+        if (retv != UP_SUCCESS) {
+            perror("up_pool_worker:up_pool_take");
+            break;
+        }
+
+        up_pool_execute(pool, worker, &task);
+
+        /* Yielded fibers take turns with the taken tasks. */
+        up_pool_run_ready(pool, worker);
+    }
+
+    up_pool_worker_stop(pool, worker);
+
+    __atomic_store_n(&worker->state, UP_WORKER_EXITED, __ATOMIC_RELEASE);
+
+    if (__atomic_sub_fetch(&pool->running, 1, __ATOMIC_SEQ_CST) == 0) {
+        __atomic_store_n(&pool->stopped, 1, __ATOMIC_SEQ_CST);
+        up_futex_wake(&pool->stopped, INT_MAX);
+    }
+
+    return NULL;
+}
+
+#ifdef __linux__
+/* Read a sysfs list of CPUs or nodes, such as "0-3,8-11", into `set`. */
+static int up_read_cpu_list(const char *path, cpu_set_t *set)
+{
+    int c;
+    FILE *f;
+    unsigned long first, last;
+
+    CPU_ZERO(set);
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    while (fscanf(f, "%lu", &first) == 1) {
+        last = first;
+
+        c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%lu", &last) != 1) {
+                break;
+            }
+            c = fgetc(f);
+        }
+
+        for ( ; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, set);
+        }
+
+        if (c != ',') {
+            break;
+        }
+    }
+
+    fclose(f);
+
+    return 1;
+}
+#endif
+
+/* Spread the pool over the NUMA nodes the process may run on.
+ *
+ * Nodes are read from sysfs and restricted to the CPUs of the process'
+ * affinity mask, nodes left without CPUs are skipped. Without NUMA
+ * information, or with `UP_AFFINITY_NONE`, all the CPUs form one node.
+ */
+static int up_pool_init_domains(up_pool_t *pool, int affinity)
+{
+    size_t i;
+#ifdef __linux__
+    int cpu;
+    size_t node, count;
+    char path[64];
+    cpu_set_t allowed, nodes, cpus;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+        up_handle_error("up_pool_create:sched_getaffinity", UP_ERROR_CONF_INVAL);
+    }
+
+    count = 1;
+    if (affinity != UP_AFFINITY_NONE &&
+        up_read_cpu_list("/sys/devices/system/node/online", &nodes) && CPU_COUNT(&nodes) > 0) {
+        count = CPU_COUNT(&nodes);
+    } else {
+        CPU_ZERO(&nodes);
+    }
+
+    pool->domains = (up_domain_t *) malloc(count * sizeof(up_domain_t));
+    pool->cpu_domain = (int *) calloc(CPU_SETSIZE, sizeof(int));
+    if (pool->domains == NULL || pool->cpu_domain == NULL) {
+        up_handle_error("up_pool_create:malloc", UP_ERROR_MALLOC);
+    }
+
+    pool->domain_count = 0;
+
+    for (node = 0; node < CPU_SETSIZE; node++) {
+        if (!CPU_ISSET(node, &nodes)) {
+            continue;
+        }
+
+        sprintf(path, "/sys/devices/system/node/node%lu/cpulist", (unsigned long) node);
+        if (!up_read_cpu_list(path, &cpus)) {
+            continue;
+        }
+
+        CPU_AND(&cpus, &cpus, &allowed);
+        if (CPU_COUNT(&cpus) == 0) {
+            continue;
+        }
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpus)) {
+                pool->cpu_domain[cpu] = (int) pool->domain_count;
+            }
+        }
+
+        memcpy(&pool->domains[pool->domain_count].cpus, &cpus, sizeof(cpu_set_t));
+        pool->domain_count++;
+    }
+
+    if (pool->domain_count == 0) {
+        memcpy(&pool->domains[0].cpus, &allowed, sizeof(cpu_set_t));
+        pool->domain_count = 1;
+    }
+#else
+    pool->domains = (up_domain_t *) malloc(sizeof(up_domain_t));
+    if (pool->domains == NULL) {
+        up_handle_error("up_pool_create:malloc", UP_ERROR_MALLOC);
+    }
+
+    pool->domain_count = 1;
+    pool->cpu_domain = NULL;
+#endif
+
+    for (i = 0; i < pool->domain_count; i++) {
+        up_queue_init(&pool->domains[i].queue);
+    }
+
+    return UP_SUCCESS;
+}
+
+/* Create the thread of `worker`, pinned according to `pool->affinity`.
+ *
+ * With `UP_AFFINITY_CPU` the workers of a node take its CPUs in turn.
+ * Returns the error number of the first attribute refused, or of
+ * `pthread_create`.
+ */
+static int up_pool_start_worker(up_pool_t *pool, up_worker_t *worker)
+{
+    int retv;
+    pthread_attr_t attr;
+    struct sched_param param;
+#ifdef __linux__
+    int cpu;
+    size_t k;
+    cpu_set_t set;
+    char name[32];
+    up_domain_t *domain = &pool->domains[worker->domain];
+#endif
+
+    retv = pthread_attr_init(&attr);
+    if (retv != 0) {
+        return retv;
+    }
+
+    retv = pthread_attr_setstacksize(&attr, pool->stack_size);
+    if (retv == 0) {
+        retv = pthread_attr_setguardsize(&attr, pool->guard_size);
+    }
+
+    if (retv == 0 && pool->sched_policy != UP_SCHED_INHERIT) {
+        param.sched_priority = pool->sched_priority;
+
+        retv = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (retv == 0) {
+            retv = pthread_attr_setschedpolicy(&attr, pool->sched_policy);
+        }
+        if (retv == 0) {
+            retv = pthread_attr_setschedparam(&attr, &param);
+        }
+    }
+
+#ifdef __linux__
+    if (pool->affinity == UP_AFFINITY_NODE) {
+        memcpy(&set, &domain->cpus, sizeof(cpu_set_t));
+    } else if (pool->affinity == UP_AFFINITY_CPU) {
+        k = (worker->index / pool->domain_count) % CPU_COUNT(&domain->cpus);
+
+        for (cpu = 0; !CPU_ISSET(cpu, &domain->cpus) || k-- > 0; cpu++) { }
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+
+    if (retv == 0 && pool->affinity != UP_AFFINITY_NONE) {
+        retv = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &set);
+    }
+#endif
+
+    if (retv == 0) {
+        retv = pthread_create(&pool->threads[worker->index], &attr, up_pool_worker, worker);
+    }
+
+    pthread_attr_destroy(&attr);
+
+#ifdef __linux__
+    /* Thread names are at most 15 characters long. */
+    if (retv == 0 && pool->name[0] != '\0') {
+        sprintf(name, "%.10s-%lu", pool->name, (unsigned long) worker->index);
+        name[15] = '\0';
+
+        pthread_setname_np(pool->threads[worker->index], name);
+    }
+#endif
+
+    return retv;
+}
+
+/* Add a worker to an elastic pool if tasks are queuing up.
+ *
+ * Called by producers when no worker is parked. The depth counts every
+ * queue of the pool, the wait is the one of the last timed task taken.
+ * The `pool->resize_lock` is only tried, producers never wait for one
+ * another to start a thread. The slot of a retired worker is reused once
+ * its thread is joined.
+ */
+static void up_pool_grow(up_pool_t *pool)
+{
+    size_t i, depth;
+    up_worker_t *worker;
+
+    if (__atomic_load_n(&pool->running, __ATOMIC_RELAXED) >= pool->thread_count) {
+        return;
+    }
+
+    if (!__atomic_load_n(&pool->late, __ATOMIC_RELAXED)) {
+        up_pool_queue_size(pool, &depth);
+        if (depth < __atomic_load_n(&pool->grow_depth, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+
+    if (pthread_mutex_trylock(&pool->resize_lock) != 0) {
+        return;
+    }
+
+    for (i = 0; i < pool->thread_count &&
+                !__atomic_load_n(&pool->shutdown, __ATOMIC_RELAXED); i++) {
+        worker = &pool->workers[i];
+
+        if (__atomic_load_n(&worker->state, __ATOMIC_ACQUIRE) == UP_WORKER_RUNNING) {
+            continue;
+        }
+
+        if (worker->state == UP_WORKER_EXITED) {
+            pthread_join(pool->threads[i], NULL);
+        }
+
+        worker->state = UP_WORKER_RUNNING;
+        __atomic_add_fetch(&pool->running, 1, __ATOMIC_SEQ_CST);
+
+        if (up_pool_start_worker(pool, worker) != 0) {
+            worker->state = UP_WORKER_STOPPED;
+            __atomic_sub_fetch(&pool->running, 1, __ATOMIC_SEQ_CST);
+        }
+
+        break;
+    }
+
+    pthread_mutex_unlock(&pool->resize_lock);
+}
+
+/* Destroy a pool of which only the first `started` of `min` workers
+ * could be started. The others are marked stopped and uncounted, as if
+ * they had exited, so that the pool shuts down as usual.
+ */
+static void up_pool_abort_start(up_pool_t *pool, size_t started, size_t min)
+{
+    size_t i;
+
+    for (i = started; i < min; i++) {
+        pool->workers[i].state = UP_WORKER_STOPPED;
+    }
+
+    if (__atomic_sub_fetch(&pool->running, min - started, __ATOMIC_SEQ_CST) == 0) {
+        __atomic_store_n(&pool->stopped, 1, __ATOMIC_SEQ_CST);
+    }
+
+    up_pool_destroy(pool);
+}
+
+/* Create a new thread pool.
+ *
+ * After allocating resources the threads are beeing created. A
+ * `capacity` of zero creates an unbounded (linked list) task queue.
+ * Workers are assigned to the NUMA nodes in turn. If a thread can't be
+ * created, those already started are stopped and the pool destroyed.
+ */
+static int up_pool_init(up_pool_t **pool, const up_pool_attr_t *attr)
+{
+    int retv, affinity;
+    size_t i, n, min, capacity;
+    void *mem;
+    up_pool_t *p;
+
+    n = attr->max_threads;
+    min = attr->min_threads != 0 ? attr->min_threads : n;
+    capacity = attr->queue == UP_QUEUE_RING ? attr->capacity : 0;
+    affinity = attr->affinity;
+
+    if (n < 1 || min > n ||
+        affinity < UP_AFFINITY_NONE || affinity > UP_AFFINITY_CPU ||
+        (attr->queue != UP_QUEUE_LIST && attr->queue != UP_QUEUE_RING) ||
+        (attr->queue == UP_QUEUE_RING && capacity < 1) ||
+        attr->stack_size < PTHREAD_STACK_MIN ||
+        attr->guard_size >= attr->stack_size) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    /* Unknown policies have no priority range. */
+    if (attr->sched_policy != UP_SCHED_INHERIT &&
+        (sched_get_priority_min(attr->sched_policy) == -1 ||
+         attr->sched_priority < sched_get_priority_min(attr->sched_policy) ||
+         attr->sched_priority > sched_get_priority_max(attr->sched_policy))) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    pthread_once(&up_worker_key_once, up_worker_key_create);
+
+    if (posix_memalign(&mem, UP_CACHE_LINE, sizeof(up_pool_t)) != 0) {
+        up_handle_error("up_pool_create:posix_memalign", UP_ERROR_MALLOC);
+    }
+
+    p = (up_pool_t *) mem;
+
+    p->thread_count = n;
+    p->min_threads = min;
+    p->running = min;
+    p->grow_depth = UP_GROW_DEPTH;
+    p->grow_wait_ns = 0;
+    p->late = 0;
+    p->idle_ns = UP_IDLE_NS;
+    p->affinity = affinity;
+    p->stack_size = attr->stack_size;
+    p->guard_size = attr->guard_size;
+    p->sched_policy = attr->sched_policy;
+    p->sched_priority = attr->sched_priority;
+    p->shutdown = 0;
+
+    memset(p->name, 0, sizeof(p->name));
+    if (attr->name != NULL) {
+        strncpy(p->name, attr->name, sizeof(p->name) - 1);
+    }
+    p->stopped = 0;
+
+    pthread_mutex_init(&p->resize_lock, NULL);
+
+    p->enq_count = 0;
+    p->deq_count = 0;
+
+    p->threads = (pthread_t *) malloc(n * sizeof(pthread_t));
+    if (p->threads == NULL) {
+        up_handle_error("up_pool_create:malloc", UP_ERROR_MALLOC);
+    }
+
+    pthread_mutex_init(&p->enq_lock, NULL);
+    pthread_mutex_init(&p->deq_lock, NULL);
+
+    p->head = (up_node_t *) calloc(1, sizeof(up_node_t));
+    if (p->head == NULL) {
+        up_handle_error("up_pool_create:calloc", UP_ERROR_MALLOC);
+    }
+
+    p->tail = p->head;
+
+    p->ring = NULL;
+    if (capacity > 0) {
+        p->ring = up_ring_create(capacity);
+        if (p->ring == NULL) {
+            up_handle_error("up_pool_create:up_ring_create", UP_ERROR_MALLOC);
+        }
+    }
+
+    p->lanes = (up_producer_t *) calloc(UP_LANES_MAX, sizeof(up_producer_t));
+    if (p->lanes == NULL) {
+        up_handle_error("up_pool_create:calloc", UP_ERROR_MALLOC);
+    }
+
+    p->lane_count = 0;
+
+    for (i = 0; i < UP_LANES_MAX; i++) {
+        p->lanes[i].pool = p;
+    }
+
+    p->groups = (up_group_t *) calloc(UP_GROUPS_MAX, sizeof(up_group_t));
+    if (p->groups == NULL) {
+        up_handle_error("up_pool_create:calloc", UP_ERROR_MALLOC);
+    }
+
+    p->group_count = 0;
+    p->group_next = 0;
+    p->group_queued = 0;
+    pthread_mutex_init(&p->group_lock, NULL);
+
+    p->strands = NULL;
+
+    for (i = 0; i < UP_GROUPS_MAX; i++) {
+        up_queue_init(&p->groups[i].queue);
+        p->groups[i].pool = p;
+    }
+
+    for (i = 0; i < UP_PRIO_LEVELS; i++) {
+        up_queue_init(&p->levels[i].queue);
+        p->levels[i].age = 0;
+    }
+
+    retv = up_pool_init_domains(p, affinity);
+    if (retv != UP_SUCCESS) {
+        return retv;
+    }
+
+    p->full_policy = UP_POLICY_BLOCK;
+    p->idle = 0;
+    p->park_seq = 0;
+    p->spin_ns = UP_SPIN_NS;
+    p->low_latency = 0;
+    p->full_waiters = 0;
+
+    pthread_cond_init(&p->full_cond, NULL);
+
+    p->inflight = 0;
+    p->stats_enabled = 0;
+
+    memset(&p->ext_stats, 0, sizeof(up_stats_t));
+
+    p->quiescent_waiters = 0;
+    p->quiescent_seq = 0;
+
+    pthread_mutex_init(&p->handle_lock, NULL);
+
+    p->free_handles = NULL;
+    p->handle_slabs = NULL;
+
+    memset(&p->wheel, 0, sizeof(up_wheel_t));
+    pthread_mutex_init(&p->wheel.lock, NULL);
+
+    p->wheel.origin = up_clock_ns();
+    p->wheel.wake_tick = ULONG_MAX;
+
+    pthread_mutex_init(&p->reactor.lock, NULL);
+
+    p->reactor.epfd = -1;
+    p->reactor.wakefd = -1;
+    p->reactor.started = 0;
+    p->reactor.waits = NULL;
+
+    pthread_mutex_init(&p->fiber_lock, NULL);
+
+    p->fibers = NULL;
+
+    p->hooks_set = 0;
+    p->on_start = NULL;
+    p->on_stop = NULL;
+    p->hook_ctx = NULL;
+
+    pthread_mutex_init(&p->token_lock, NULL);
+
+    p->tokens = NULL;
+
+    if (posix_memalign(&mem, UP_CACHE_LINE, n * sizeof(up_worker_t)) != 0) {
+        up_handle_error("up_pool_create:posix_memalign", UP_ERROR_MALLOC);
+    }
+
+    p->workers = (up_worker_t *) mem;
+
+    for (i = 0; i < n; i++) {
+        if (!up_deque_init(&p->workers[i].deque)) {
+            up_handle_error("up_pool_create:up_deque_init", UP_ERROR_MALLOC);
+        }
+
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        p->workers[i].domain = i % p->domain_count;
+        p->workers[i].seed = (unsigned int) i;
+        p->workers[i].lane_next = i;
+        p->workers[i].fiber = NULL;
+        p->workers[i].back = NULL;
+        p->workers[i].ready = NULL;
+        p->workers[i].ready_tail = NULL;
+        p->workers[i].free_fibers = NULL;
+        p->workers[i].arena.block = NULL;
+        p->workers[i].arena.used = 0;
+        p->workers[i].arena.spare = NULL;
+        p->workers[i].hooked = 0;
+        p->workers[i].skipped = 0;
+        p->workers[i].state = i < min ? UP_WORKER_RUNNING : UP_WORKER_STOPPED;
+
+        memset(&p->workers[i].stats, 0, sizeof(up_stats_t));
+    }
+
+    for (i = 0; i < min; i++) {
+        retv = up_pool_start_worker(p, &p->workers[i]);
+        if (retv != 0) {
+            up_pool_abort_start(p, i, min);
+            up_handle_error_en("up_pool_create:pthread_create", retv, UP_ERROR_THREAD_CREATE);
+        }
+    }
+
+    *pool = p;
+
+    return UP_SUCCESS;
+}
+
+/* Set the attributes to their defaults. */
+int up_pool_attr_init(up_pool_attr_t *attr)
+{
+    long cpus = 1;
+    pthread_attr_t defaults;
+
+#ifdef __linux__
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    attr->max_threads = cpus > 0 ? (size_t) cpus : 1;
+    attr->min_threads = 0;
+    attr->queue = UP_QUEUE_DEFAULT;
+    attr->capacity = UP_QUEUE_CAPACITY;
+    attr->affinity = UP_AFFINITY_NONE;
+    attr->sched_policy = UP_SCHED_INHERIT;
+    attr->sched_priority = 0;
+    attr->name = NULL;
+
+    /* The defaults of the system, as if no attributes were given. */
+    pthread_attr_init(&defaults);
+    pthread_attr_getstacksize(&defaults, &attr->stack_size);
+    pthread_attr_getguardsize(&defaults, &attr->guard_size);
+    pthread_attr_destroy(&defaults);
+
+    return UP_SUCCESS;
+}
+
+/* Create a new thread pool as described by `attr`. */
+int up_pool_create_ex(up_pool_t **pool, const up_pool_attr_t *attr)
+{
+    return up_pool_init(pool, attr);
+}
+
+/* Create a new thread pool with an unbounded task queue. */
+int up_pool_create(up_pool_t **pool, size_t n)
+{
+    up_pool_attr_t attr;
+
+    up_pool_attr_init(&attr);
+    attr.max_threads = n;
+    attr.queue = UP_QUEUE_LIST;
+
+    return up_pool_init(pool, &attr);
+}
+
+/* Create a new thread pool with a bounded task queue. */
+int up_pool_create_bounded(up_pool_t **pool, size_t n, size_t capacity)
+{
+    up_pool_attr_t attr;
+
+    up_pool_attr_init(&attr);
+    attr.max_threads = n;
+    attr.queue = UP_QUEUE_RING;
+    attr.capacity = capacity;
+
+    return up_pool_init(pool, &attr);
+}
+
+/* Create a new thread pool of `min` to `max` threads. */
+int up_pool_create_elastic(up_pool_t **pool, size_t min, size_t max)
+{
+    up_pool_attr_t attr;
+
+    if (min < 1) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    up_pool_attr_init(&attr);
+    attr.max_threads = max;
+    attr.min_threads = min;
+    attr.queue = UP_QUEUE_LIST;
+
+    return up_pool_init(pool, &attr);
+}
+
+/* Set when an elastic pool grows and shrinks. */
+int up_pool_set_elastic(up_pool_t *pool, size_t grow_depth, unsigned long idle_ns)
+{
+    __atomic_store_n(&pool->grow_depth, grow_depth, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->idle_ns, idle_ns, __ATOMIC_RELAXED);
+
+    return UP_SUCCESS;
+}
+
+/* Set the wait in queue above which an elastic pool grows. */
+int up_pool_set_grow_wait(up_pool_t *pool, unsigned long wait_ns)
+{
+    __atomic_store_n(&pool->grow_wait_ns, wait_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->late, 0, __ATOMIC_RELAXED);
+
+    return UP_SUCCESS;
+}
+
+/* Return the number of running threads of the pool. */
+int up_pool_thread_count(up_pool_t *pool, size_t *count)
+{
+    *count = __atomic_load_n(&pool->running, __ATOMIC_RELAXED);
+
+    return UP_SUCCESS;
+}
+
+/* Create a new thread pool spread over the NUMA nodes. */
+int up_pool_create_numa(up_pool_t **pool, size_t n, int affinity)
+{
+    up_pool_attr_t attr;
+
+    up_pool_attr_init(&attr);
+    attr.max_threads = n;
+    attr.queue = UP_QUEUE_LIST;
+    attr.affinity = affinity;
+
+    return up_pool_init(pool, &attr);
+}
+
+/* Return the number of NUMA nodes of the pool. */
+int up_pool_node_count(up_pool_t *pool, size_t *count)
+{
+    *count = pool->domain_count;
+
+    return UP_SUCCESS;
+}
+
+/* Set the full queue policy of a bounded pool. */
+int up_pool_set_full_policy(up_pool_t *pool, int policy)
+{
+    if (pool->ring == NULL ||
+        (policy != UP_POLICY_BLOCK &&
+         policy != UP_POLICY_REJECT &&
+         policy != UP_POLICY_CALLER_RUNS)) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    __atomic_store_n(&pool->full_policy, policy, __ATOMIC_RELAXED);
+
+    return UP_SUCCESS;
+}
+
+/* Set the time idle workers spin before parking. */
+int up_pool_set_spin(up_pool_t *pool, unsigned long spin_ns)
+{
+    __atomic_store_n(&pool->spin_ns, spin_ns, __ATOMIC_RELAXED);
+
+    return UP_SUCCESS;
+}
+
+/* Enable or disable the low latency mode.
+ *
+ * Parked workers are woken up so that they start spinning.
+ */
+int up_pool_set_low_latency(up_pool_t *pool, int enable)
+{
+    __atomic_store_n(&pool->low_latency, enable != 0, __ATOMIC_RELAXED);
+
+    if (enable) {
+        up_pool_wake_n(pool, pool->thread_count);
+    }
+
+    return UP_SUCCESS;
+}
+
+/* Enable or disable timing tasks. */
+int up_pool_set_stats(up_pool_t *pool, int enable)
+{
+    __atomic_store_n(&pool->stats_enabled, enable != 0, __ATOMIC_RELAXED);
+
+    return UP_SUCCESS;
+}
+
+/* Set the hooks called by the workers when they start and exit. */
+int up_pool_set_worker_hooks(up_pool_t *pool, void (*on_start) (void *, size_t),
+                             void (*on_stop) (void *, size_t), void *ctx)
+{
+    /* Checked and set under the lock, so only one caller succeeds. */
+    pthread_mutex_lock(&pool->resize_lock);
+
+    if (pool->hooks_set) {
+        pthread_mutex_unlock(&pool->resize_lock);
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    pool->on_start = on_start;
+    pool->on_stop = on_stop;
+    pool->hook_ctx = ctx;
+
+    __atomic_store_n(&pool->hooks_set, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&pool->resize_lock);
+
+    return UP_SUCCESS;
+}
+
+/* Add the statistics `src`, concurrently updated, to `dst`. */
+static void up_stats_add(up_stats_t *dst, up_stats_t *src)
+{
+    size_t i;
+
+    dst->executed += __atomic_load_n(&src->executed, __ATOMIC_RELAXED);
+    dst->cancelled += __atomic_load_n(&src->cancelled, __ATOMIC_RELAXED);
+    dst->busy_ns += __atomic_load_n(&src->busy_ns, __ATOMIC_RELAXED);
+    dst->idle_ns += __atomic_load_n(&src->idle_ns, __ATOMIC_RELAXED);
+    dst->enq_contended += __atomic_load_n(&src->enq_contended, __ATOMIC_RELAXED);
+    dst->deq_contended += __atomic_load_n(&src->deq_contended, __ATOMIC_RELAXED);
+
+    for (i = 0; i < UP_STATS_BUCKETS; i++) {
+        dst->wait_hist[i] += __atomic_load_n(&src->wait_hist[i], __ATOMIC_RELAXED);
+        dst->run_hist[i] += __atomic_load_n(&src->run_hist[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Return the statistics of the whole pool. */
+int up_pool_stats(up_pool_t *pool, up_stats_t *stats)
+{
+    size_t i;
+
+    memset(stats, 0, sizeof(up_stats_t));
+
+    for (i = 0; i < pool->thread_count; i++) {
+        up_stats_add(stats, &pool->workers[i].stats);
+    }
+
+    up_stats_add(stats, &pool->ext_stats);
+
+    return UP_SUCCESS;
+}
+
+/* Return the statistics of a worker. */
+int up_pool_worker_stats(up_pool_t *pool, size_t i, up_stats_t *stats)
+{
+    if (i >= pool->thread_count) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    memset(stats, 0, sizeof(up_stats_t));
+
+    up_stats_add(stats, &pool->workers[i].stats);
+
+    return UP_SUCCESS;
+}
+
+/* Set the shutdown mode of the pool and wake up all the waiting threads.
+ *
+ * The mode is only ever escalated, under `pool->resize_lock` so that no
+ * thread is started from then on. Parked workers are woken up with a
+ * broadcast, as are producers blocked on a full ring.
+ */
+static void up_pool_set_shutdown(up_pool_t *pool, int mode)
+{
+    pthread_mutex_lock(&pool->resize_lock);
+    if (mode > pool->shutdown) {
+        __atomic_store_n(&pool->shutdown, mode, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&pool->resize_lock);
+
+    __atomic_add_fetch(&pool->park_seq, 1, __ATOMIC_SEQ_CST);
+    up_futex_wake(&pool->park_seq, INT_MAX);
+
+    __atomic_add_fetch(&pool->wheel.seq, 1, __ATOMIC_SEQ_CST);
+    up_futex_wake(&pool->wheel.seq, INT_MAX);
+
+    up_reactor_wake(&pool->reactor);
+
+    pthread_mutex_lock(&pool->enq_lock);
+    pthread_cond_broadcast(&pool->full_cond);
+    pthread_mutex_unlock(&pool->enq_lock);
+}
+
+/* Shut the pool down and wait for its workers to exit.
+ *
+ * Workers exit on their own, see `up_pool_worker`, the caller waits on
+ * the `pool->stopped` futex.
+ */
+int up_pool_shutdown(up_pool_t *pool, int mode, const struct timespec *abstime)
+{
+    if (mode != UP_SHUTDOWN_DRAIN && mode != UP_SHUTDOWN_DISCARD) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    if (up_pool_current_worker(pool) != NULL) {
+        return UP_ERROR_DEADLOCK;
+    }
+
+    up_pool_set_shutdown(pool, mode);
+
+    while (!__atomic_load_n(&pool->stopped, __ATOMIC_SEQ_CST)) {
+        if (up_futex_wait(&pool->stopped, 0, abstime) == ETIMEDOUT &&
+            !__atomic_load_n(&pool->stopped, __ATOMIC_SEQ_CST)) {
+            /* Out of time, drop the tasks still queued. */
+            up_pool_set_shutdown(pool, UP_SHUTDOWN_DISCARD);
+            return UP_ERROR_TIMEDOUT;
+        }
+    }
+
+    return UP_SUCCESS;
+}
+
+/* Destroy the thread pool.
+ *
+ * First shut the pool down, then `pthread_join` all the threads that
+ * were started and release allocated resources. Tasks left in the queues
+ * are freed without running.
+ */
+int up_pool_destroy(up_pool_t *pool)
+{
+    int retv;
+    size_t i;
+    up_fiber_t *fiber;
+    up_token_t *token;
+    up_handle_slab_t *slab;
+
+    retv = up_pool_shutdown(pool, UP_SHUTDOWN_DRAIN, NULL);
+    if (retv != UP_SUCCESS) {
+        return retv;
+    }
+
+    for (i = 0; i < pool->thread_count; i++) {
+        if (__atomic_load_n(&pool->workers[i].state, __ATOMIC_ACQUIRE) == UP_WORKER_STOPPED) {
+            continue;
+        }
+
+        retv = pthread_join(pool->threads[i], NULL);
+        if (retv != 0) {
+            up_handle_error("up_pool_destroy:pthread_join", UP_ERROR_THREAD_JOIN);
+        }
+    }
+
+    free(pool->threads);
+
+    retv = up_wheel_destroy(&pool->wheel);
+    if (retv != UP_SUCCESS) {
+        return retv;
+    }
+
+    retv = up_reactor_destroy(&pool->reactor);
+    if (retv != UP_SUCCESS) {
+        return retv;
+    }
+
+    for (i = 0; i < pool->thread_count; i++) {
+        up_deque_destroy(&pool->workers[i].deque);
+
+        up_arena_release(&pool->workers[i].arena, NULL, 0);
+        free(pool->workers[i].arena.spare);
+    }
+
+    free(pool->workers);
+
+    while (pool->fibers != NULL) {
+        fiber = pool->fibers;
+        pool->fibers = fiber->all;
+        free(fiber->stack);
+        free(fiber);
+    }
+
+    retv = pthread_mutex_destroy(&pool->fiber_lock);
+    if (retv != 0) {
+        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    }
+
+    while (pool->tokens != NULL) {
+        token = pool->tokens;
+        pool->tokens = token->next;
+        free(token);
+    }
+
+    retv = pthread_mutex_destroy(&pool->token_lock);
+    if (retv != 0) {
+        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    }
+
+    retv = pthread_cond_destroy(&pool->full_cond);
+    if (retv != 0) {
+        up_handle_error("up_pool_destroy:pthread_cond_destroy", UP_ERROR_COND_DESTROY);
+    }
+
+    retv = pthread_mutex_destroy(&pool->enq_lock);
+    if (retv != 0) {
+        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    }
+
+    retv = pthread_mutex_destroy(&pool->deq_lock);
+    if (retv != 0) {
+        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    }
+
+    retv = pthread_mutex_destroy(&pool->resize_lock);
+    if (retv != 0) {
+        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    }
+
+    retv = pthread_mutex_destroy(&pool->handle_lock);
+    if (retv != 0) {
+        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    }
+
+    while (pool->handle_slabs != NULL) {
+        slab = pool->handle_slabs;
+        pool->handle_slabs = slab->next;
+        free(slab);
+    }
+
+    for (i = 0; i < UP_PRIO_LEVELS; i++) {
+        retv = up_queue_destroy(&pool->levels[i].queue);
+        if (retv != UP_SUCCESS) {
+            return retv;
+        }
+    }
+
+    for (i = 0; i < pool->domain_count; i++) {
+        retv = up_queue_destroy(&pool->domains[i].queue);
+        if (retv != UP_SUCCESS) {
+            return retv;
+        }
+    }
+
+    for (i = 0; i < pool->lane_count; i++) {
+        if (pool->lanes[i].ring != NULL) {
+            up_ring_destroy(pool->lanes[i].ring);
+        }
+    }
+
+    free(pool->lanes);
+
+    for (i = 0; i < UP_GROUPS_MAX; i++) {
+        retv = up_queue_destroy(&pool->groups[i].queue);
+        if (retv != UP_SUCCESS) {
+            return retv;
+        }
+    }
+
+    free(pool->groups);
+
+    if (pool->strands != NULL) {
+        for (i = 0; i < UP_STRANDS; i++) {
+            retv = up_queue_destroy(&pool->strands[i].queue);
+            if (retv != UP_SUCCESS) {
+                return retv;
+            }
+        }
+
+        free(pool->strands);
+    }
+
+    retv = pthread_mutex_destroy(&pool->group_lock);
+    if (retv != 0) {
+        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    }
+
+    free(pool->domains);
+    free(pool->cpu_domain);
+
+    up_nodes_free(pool->head);
+
+    if (pool->ring != NULL) {
+        up_ring_destroy(pool->ring);
+    }
+
+    free(pool);
+
+    return UP_SUCCESS;
+}
+
+/* Queue a task already counted in `pool->inflight`, applying the full
+ * queue `policy`. The count is released if the task can't be queued.
+ *
+ * An unbounded queue is never full, there `UP_POLICY_REJECT` only means
+ * that the producer does not wait for the queue's lock. Deques are never
+ * full either.
+ */
+static int up_pool_submit_counted(up_pool_t *pool, up_task_t *task, int policy,
+                                  const struct timespec *abstime)
+{
+    int retv;
+    up_worker_t *worker;
+
+    /* Tasks spawned by a task go to the deque of the worker running it. */
+    worker = up_pool_current_worker(pool);
+    if (worker != NULL) {
+        retv = up_deque_push(&worker->deque, task);
+        if (retv != UP_SUCCESS) {
+            up_pool_done_n(pool, 1);
+            return retv;
+        }
+
+        up_pool_wake(pool);
+
+        return UP_SUCCESS;
+    }
+
+    if (pool->ring == NULL) {
+        retv = up_pool_enq(pool, task, policy == UP_POLICY_REJECT);
+    } else {
+        retv = up_pool_ring_enq(pool, task, policy == UP_POLICY_BLOCK, abstime);
+
+        if (retv == UP_ERROR_QUEUE_FULL && policy == UP_POLICY_CALLER_RUNS) {
+            up_task_run(task);
+            retv = UP_SUCCESS;
+            up_pool_done_n(pool, 1);
+        }
+    }
+
+    if (retv != UP_SUCCESS) {
+        up_pool_done_n(pool, 1);
+    }
+
+    return retv;
+}
+
+/* Submit a new task to the pool's queue applying the full queue `policy`.
+ *
+ * The task is counted in `pool->inflight` before it's queued, so that it
+ * can't complete before being counted.
+ */
+static int up_pool_submit_task(up_pool_t *pool, up_task_t *task, int policy,
+                               const struct timespec *abstime)
+{
+    __atomic_add_fetch(&pool->inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (up_pool_closed(pool)) {
+        up_pool_done_n(pool, 1);
+        return UP_ERROR_SHUTDOWN;
+    }
+
+    return up_pool_submit_counted(pool, task, policy, abstime);
+}
+
+/* Submit a new task to the pool's queue. */
+int up_pool_submit(up_pool_t *pool, void (*task_routine) (void *), void *arg)
+{
+    up_task_t task;
+
+    task.task_routine = task_routine;
+    task.arg = arg;
+    task.stamp = up_pool_stamp(pool);
+
+    return up_pool_submit_task(pool, &task,
+                               __atomic_load_n(&pool->full_policy, __ATOMIC_RELAXED), NULL);
+}
+
+/* Submit a new task to the pool's queue without blocking. */
+int up_pool_try_submit(up_pool_t *pool, void (*task_routine) (void *), void *arg)
+{
+    up_task_t task;
+
+    task.task_routine = task_routine;
+    task.arg = arg;
+    task.stamp = up_pool_stamp(pool);
+
+    return up_pool_submit_task(pool, &task, UP_POLICY_REJECT, NULL);
+}
+
+/* Submit a new task to the pool's queue, blocking at most until `abstime`. */
+int up_pool_submit_timed(up_pool_t *pool, void (*task_routine) (void *), void *arg,
+                         const struct timespec *abstime)
+{
+    up_task_t task;
+
+    task.task_routine = task_routine;
+    task.arg = arg;
+    task.stamp = up_pool_stamp(pool);
+
+    return up_pool_submit_task(pool, &task, UP_POLICY_BLOCK, abstime);
+}
+
+/* Link `timer` in the slot of the wheel it expires in.
+ *
+ * Timers past the span of the wheel are linked in the last slot of the
+ * top level, and go further down only as the ticks get close to them.
+ */
+static void up_wheel_add(up_wheel_t *wheel, up_timer_t *timer)
+{
+    int level;
+    unsigned long expires, delta, span;
+
+    expires = timer->expires > wheel->tick ? timer->expires : wheel->tick;
+    delta = expires - wheel->tick;
+
+    span = 1UL << (UP_WHEEL_BITS * UP_WHEEL_LEVELS);
+    if (delta >= span) {
+        expires = wheel->tick + span - 1;
+        delta = span - 1;
+    }
+
+    for (level = 0; level < UP_WHEEL_LEVELS - 1; level++) {
+        if (delta < 1UL << (UP_WHEEL_BITS * (level + 1))) {
+            break;
+        }
+    }
+
+    timer->level = level;
+    timer->slot = &wheel->slots[level][(expires >> (UP_WHEEL_BITS * level)) & UP_WHEEL_MASK];
+    timer->prev = NULL;
+    timer->next = *timer->slot;
+
+    if (timer->next != NULL) {
+        timer->next->prev = timer;
+    }
+
+    *timer->slot = timer;
+    wheel->counts[level]++;
+}
+
+/* Unlink `timer` from its slot. */
+static void up_wheel_del(up_wheel_t *wheel, up_timer_t *timer)
+{
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+
+    wheel->counts[timer->level]--;
+}
+
+/* Queue the task of an expired timer in `wheel->fired`. */
+static int up_wheel_fire(up_wheel_t *wheel, up_timer_t *timer)
+{
+    size_t size;
+    up_task_t *fired;
+
+    if (wheel->fired_count == wheel->fired_size) {
+        size = wheel->fired_size > 0 ? 2 * wheel->fired_size : 64;
+
+        fired = (up_task_t *) realloc(wheel->fired, size * sizeof(up_task_t));
+        if (fired == NULL) {
+            up_handle_error("up_wheel_fire:realloc", UP_ERROR_MALLOC);
+        }
+
+        wheel->fired = fired;
+        wheel->fired_size = size;
+    }
+
+    fired = &wheel->fired[wheel->fired_count++];
+
+    fired->task_routine = timer->task_routine;
+    fired->arg = timer->arg;
+    fired->stamp = 0;
+
+    return UP_SUCCESS;
+}
+
+/* Link again the timers of a slot of `level`, one level down or more. */
+static void up_wheel_cascade(up_wheel_t *wheel, int level, size_t slot)
+{
+    up_timer_t *timer, *next;
+
+    timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+
+    for ( ; timer != NULL; timer = next) {
+        next = timer->next;
+        wheel->counts[level]--;
+
+        up_wheel_add(wheel, timer);
+    }
+}
+
+/* Return the tick the wheel has to be processed at, `ULONG_MAX` if no
+ * timer is linked. Timers of the levels above 0 need the wheel at the
+ * next tick their level is cascaded at. */
+static unsigned long up_wheel_next(up_wheel_t *wheel)
+{
+    int level;
+    size_t i;
+    unsigned long next, span;
+
+    next = ULONG_MAX;
+
+    if (wheel->counts[0] > 0) {
+        for (i = 0; i < UP_WHEEL_SLOTS; i++) {
+            if (wheel->slots[0][(wheel->tick + i) & UP_WHEEL_MASK] != NULL) {
+                next = wheel->tick + i;
+                break;
+            }
+        }
+    }
+
+    for (level = 1; level < UP_WHEEL_LEVELS; level++) {
+        if (wheel->counts[level] > 0) {
+            span = 1UL << (UP_WHEEL_BITS * level);
+
+            if ((wheel->tick + span - 1) / span * span < next) {
+                next = (wheel->tick + span - 1) / span * span;
+            }
+
+            break;
+        }
+    }
+
+    return next;
+}
+
+/* Process the ticks of the wheel up to `now`.
+ *
+ * The tasks of the expired timers are queued in `wheel->fired`, then
+ * periodic timers are linked again and the others freed. Ticks with
+ * nothing to expire nor cascade are skipped.
+ */
+static void up_wheel_advance(up_wheel_t *wheel, unsigned long now)
+{
+    int level;
+    size_t slot;
+    unsigned long skip;
+    up_timer_t *timer, *next;
+
+    while (wheel->tick <= now) {
+        skip = up_wheel_next(wheel);
+        if (skip > now) {
+            wheel->tick = now + 1;
+            break;
+        }
+
+        wheel->tick = skip;
+
+        for (level = 1; level < UP_WHEEL_LEVELS; level++) {
+            if ((wheel->tick & ((1UL << (UP_WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+
+            up_wheel_cascade(wheel, level,
+                             (wheel->tick >> (UP_WHEEL_BITS * level)) & UP_WHEEL_MASK);
+        }
+
+        slot = wheel->tick & UP_WHEEL_MASK;
+
+        timer = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+
+        wheel->tick++;
+
+        for ( ; timer != NULL; timer = next) {
+            next = timer->next;
+            wheel->counts[0]--;
+
+            up_wheel_fire(wheel, timer);
+
+            if (timer->period == 0) {
+                free(timer);
+                continue;
+            }
+
+            timer->expires += timer->period;
+            up_wheel_add(wheel, timer);
+        }
+    }
+}
+
+/* Service the pool's timer wheel.
+ *
+ * The thread sleeps on the `wheel->seq` futex until the next tick with
+ * work, expired tasks are submitted out of the wheel's lock. Timers
+ * added before `wheel->wake_tick` wake it up, see `up_pool_timer_add`.
+ */
+static void *up_pool_timer_thread(void *arg)
+{
+    int seq;
+    size_t i, n;
+    unsigned long now, wake;
+    struct timespec abstime;
+    up_pool_t *pool = (up_pool_t *) arg;
+    up_wheel_t *wheel = &pool->wheel;
+
+    pthread_mutex_lock(&wheel->lock);
+
+    while (!__atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST)) {
+        up_wheel_advance(wheel, (up_clock_ns() - wheel->origin) / UP_TIMER_TICK_NS);
+
+        n = wheel->fired_count;
+        wheel->fired_count = 0;
+
+        wake = wheel->wake_tick = up_wheel_next(wheel);
+        seq = __atomic_load_n(&wheel->seq, __ATOMIC_SEQ_CST);
+
+        pthread_mutex_unlock(&wheel->lock);
+
+        /* Only this thread touches `fired`. */
+        for (i = 0; i < n; i++) {
+            up_pool_submit_task(pool, &wheel->fired[i], UP_POLICY_BLOCK, NULL);
+        }
+
+        /* `seq` was read first, so a shutdown that bumped it before is
+         * seen here and one that bumps it after ends the wait. */
+        if (__atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&wheel->lock);
+            break;
+        }
+
+        if (wake == ULONG_MAX) {
+            up_futex_wait(&wheel->seq, seq, NULL);
+        } else {
+            now = up_clock_ns();
+            wake = wheel->origin + wake * UP_TIMER_TICK_NS;
+
+            if (wake > now) {
+                up_timespec_after(&abstime, wake - now);
+                up_futex_wait(&wheel->seq, seq, &abstime);
+            }
+        }
+
+        pthread_mutex_lock(&wheel->lock);
+    }
+
+    pthread_mutex_unlock(&wheel->lock);
+
+    return NULL;
+}
+
+/* Stop the thread servicing the wheel and free its timers. */
+static int up_wheel_destroy(up_wheel_t *wheel)
+{
+    int level;
+    size_t i;
+    up_timer_t *timer, *next;
+
+    if (wheel->started && pthread_join(wheel->thread, NULL) != 0) {
+        up_handle_error("up_pool_destroy:pthread_join", UP_ERROR_THREAD_JOIN);
+    }
+
+    for (level = 0; level < UP_WHEEL_LEVELS; level++) {
+        for (i = 0; i < UP_WHEEL_SLOTS; i++) {
+            for (timer = wheel->slots[level][i]; timer != NULL; timer = next) {
+                next = timer->next;
+                free(timer);
+            }
+        }
+    }
+
+    free(wheel->fired);
+
+    if (pthread_mutex_destroy(&wheel->lock) != 0) {
+        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    }
+
+    return UP_SUCCESS;
+}
+
+/* Add a timer queueing `task_routine` after `delay_ns`, then every
+ * `period_ns` if not 0. The thread servicing the wheel is started with
+ * the first timer, and woken up if the timer expires before it would.
+ */
+static int up_pool_timer_add(up_pool_t *pool, unsigned long delay_ns, unsigned long period_ns,
+                             void (*task_routine) (void *), void *arg, up_timer_t **timer)
+{
+    int retv;
+    up_timer_t *t;
+    up_wheel_t *wheel = &pool->wheel;
+
+    if (up_pool_closed(pool)) {
+        return UP_ERROR_SHUTDOWN;
+    }
+
+    t = (up_timer_t *) malloc(sizeof(up_timer_t));
+    if (t == NULL) {
+        up_handle_error("up_pool_timer_add:malloc", UP_ERROR_MALLOC);
+    }
+
+    t->task_routine = task_routine;
+    t->arg = arg;
+    t->period = (period_ns + UP_TIMER_TICK_NS - 1) / UP_TIMER_TICK_NS;
+    t->pool = pool;
+
+    retv = pthread_mutex_lock(&wheel->lock);
+    if (retv != 0) {
+        free(t);
+        up_handle_error_en("up_pool_timer_add:pthread_mutex_lock", retv, UP_ERROR_MUTEX_LOCK);
+    }
+
+    if (!wheel->started) {
+        retv = pthread_create(&wheel->thread, NULL, up_pool_timer_thread, (void *) pool);
+        if (retv != 0) {
+            pthread_mutex_unlock(&wheel->lock);
+            free(t);
+            up_handle_error_en("up_pool_timer_add:pthread_create", retv, UP_ERROR_THREAD_CREATE);
+        }
+
+        wheel->started = 1;
+    }
+
+    t->expires = (up_clock_ns() - wheel->origin + delay_ns + UP_TIMER_TICK_NS - 1) /
+                 UP_TIMER_TICK_NS;
+
+    up_wheel_add(wheel, t);
+
+    if (t->expires < wheel->wake_tick) {
+        wheel->wake_tick = t->expires;
+
+        __atomic_add_fetch(&wheel->seq, 1, __ATOMIC_SEQ_CST);
+        up_futex_wake(&wheel->seq, 1);
+    }
+
+    pthread_mutex_unlock(&wheel->lock);
+
+    if (timer != NULL) {
+        *timer = t;
+    }
+
+    return UP_SUCCESS;
+}
+
+/* Submit a new task to be queued after a delay. */
+int up_pool_submit_delayed(up_pool_t *pool, unsigned long delay_ns,
+                           void (*task_routine) (void *), void *arg)
+{
+    return up_pool_timer_add(pool, delay_ns, 0, task_routine, arg, NULL);
+}
+
+/* Submit a new task to be queued periodically. */
+int up_pool_submit_every(up_pool_t *pool, unsigned long period_ns,
+                         void (*task_routine) (void *), void *arg, up_timer_t **timer)
+{
+    if (period_ns == 0) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    return up_pool_timer_add(pool, period_ns, period_ns, task_routine, arg, timer);
+}
+
+/* Cancel a periodic task. */
+int up_timer_cancel(up_timer_t *timer)
+{
+    up_wheel_t *wheel = &timer->pool->wheel;
+
+    pthread_mutex_lock(&wheel->lock);
+    up_wheel_del(wheel, timer);
+    pthread_mutex_unlock(&wheel->lock);
+
+    free(timer);
+
+    return UP_SUCCESS;
+}
+
+/* Unlink `wait` from the reactor's waits. */
+static void up_reactor_unlink(up_reactor_t *reactor, up_fd_wait_t *wait)
+{
+    if (wait->prev != NULL) {
+        wait->prev->next = wait->next;
+    } else {
+        reactor->waits = wait->next;
+    }
+
+    if (wait->next != NULL) {
+        wait->next->prev = wait->prev;
+    }
+}
+
+/* Wake the reactor's thread up, if started, to see the pool shut down.
+ *
+ * `started` is read under the lock, so a thread started afterwards sees
+ * the shutdown before its first wait instead.
+ */
+static void up_reactor_wake(up_reactor_t *reactor)
+{
+#ifdef __linux__
+    unsigned long one = 1;
+
+    pthread_mutex_lock(&reactor->lock);
+
+    if (reactor->started && write(reactor->wakefd, &one, sizeof(one)) < 0) {
+        perror("up_reactor_wake:write");
+    }
+
+    pthread_mutex_unlock(&reactor->lock);
+#endif
+}
+
+/* Stop the reactor's thread and free its waits. */
+static int up_reactor_destroy(up_reactor_t *reactor)
+{
+    up_fd_wait_t *wait;
+
+    if (reactor->started && pthread_join(reactor->thread, NULL) != 0) {
+        up_handle_error("up_pool_destroy:pthread_join", UP_ERROR_THREAD_JOIN);
+    }
+
+#ifdef __linux__
+    if (reactor->epfd >= 0) {
+        close(reactor->epfd);
+    }
+
+    if (reactor->wakefd >= 0) {
+        close(reactor->wakefd);
+    }
+#endif
+
+    while (reactor->waits != NULL) {
+        wait = reactor->waits;
+        reactor->waits = wait->next;
+        free(wait);
+    }
+
+    if (pthread_mutex_destroy(&reactor->lock) != 0) {
+        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    }
+
+    return UP_SUCCESS;
+}
+
+#ifdef __linux__
+
+/* Service the pool's epoll instance.
+ *
+ * Waits are registered one-shot, a ready one is removed from the epoll
+ * instance, so that its fd can be waited for again, and its task is
+ * submitted. The wake up eventfd is registered with a NULL wait.
+ */
+static void *up_pool_reactor_thread(void *arg)
+{
+    int i, n;
+    up_task_t task;
+    up_fd_wait_t *wait;
+    struct epoll_event events[64];
+    up_pool_t *pool = (up_pool_t *) arg;
+    up_reactor_t *reactor = &pool->reactor;
+
+    while (!__atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST)) {
+        n = epoll_wait(reactor->epfd, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("up_pool_reactor_thread:epoll_wait");
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            wait = (up_fd_wait_t *) events[i].data.ptr;
+            if (wait == NULL) {
+                continue;
+            }
+
+            pthread_mutex_lock(&reactor->lock);
+            up_reactor_unlink(reactor, wait);
+            epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, wait->fd, NULL);
+            pthread_mutex_unlock(&reactor->lock);
+
+            task.task_routine = wait->task_routine;
+            task.arg = wait->arg;
+            task.stamp = 0;
+
+            free(wait);
+
+            up_pool_submit_task(pool, &task, UP_POLICY_BLOCK, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/* Create the reactor's epoll instance and start its thread. */
+static int up_reactor_start(up_pool_t *pool)
+{
+    int retv;
+    struct epoll_event ev;
+    up_reactor_t *reactor = &pool->reactor;
+
+    if (reactor->epfd < 0) {
+        reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor->epfd < 0) {
+            up_handle_error("up_pool_submit_on_fd:epoll_create1", UP_ERROR_MALLOC);
+        }
+    }
+
+    if (reactor->wakefd < 0) {
+        reactor->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (reactor->wakefd < 0) {
+            up_handle_error("up_pool_submit_on_fd:eventfd", UP_ERROR_MALLOC);
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev) != 0) {
+            close(reactor->wakefd);
+            reactor->wakefd = -1;
+            up_handle_error("up_pool_submit_on_fd:epoll_ctl", UP_ERROR_MALLOC);
+        }
+    }
+
+    retv = pthread_create(&reactor->thread, NULL, up_pool_reactor_thread, (void *) pool);
+    if (retv != 0) {
+        up_handle_error_en("up_pool_submit_on_fd:pthread_create", retv, UP_ERROR_THREAD_CREATE);
+    }
+
+    reactor->started = 1;
+
+    return UP_SUCCESS;
+}
+
+#endif
+
+/* Submit a new task to be queued once `fd` is ready. */
+int up_pool_submit_on_fd(up_pool_t *pool, int fd, int events,
+                         void (*task_routine) (void *), void *arg)
+{
+#ifdef __linux__
+    int retv;
+    up_fd_wait_t *wait;
+    struct epoll_event ev;
+    up_reactor_t *reactor = &pool->reactor;
+
+    if (events == 0 || (events & ~(UP_FD_READ | UP_FD_WRITE)) != 0) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    if (up_pool_closed(pool)) {
+        return UP_ERROR_SHUTDOWN;
+    }
+
+    wait = (up_fd_wait_t *) malloc(sizeof(up_fd_wait_t));
+    if (wait == NULL) {
+        up_handle_error("up_pool_submit_on_fd:malloc", UP_ERROR_MALLOC);
+    }
+
+    wait->task_routine = task_routine;
+    wait->arg = arg;
+    wait->fd = fd;
+
+    retv = pthread_mutex_lock(&reactor->lock);
+    if (retv != 0) {
+        free(wait);
+        up_handle_error_en("up_pool_submit_on_fd:pthread_mutex_lock", retv, UP_ERROR_MUTEX_LOCK);
+    }
+
+    if (!reactor->started) {
+        retv = up_reactor_start(pool);
+        if (retv != UP_SUCCESS) {
+            pthread_mutex_unlock(&reactor->lock);
+            free(wait);
+            return retv;
+        }
+    }
+
+    wait->prev = NULL;
+    wait->next = reactor->waits;
+    if (wait->next != NULL) {
+        wait->next->prev = wait;
+    }
+    reactor->waits = wait;
+
+    ev.events = EPOLLONESHOT;
+    ev.events |= (events & UP_FD_READ) ? EPOLLIN : 0;
+    ev.events |= (events & UP_FD_WRITE) ? EPOLLOUT : 0;
+    ev.data.ptr = wait;
+
+    /* Fails if `fd` is invalid or already waited for. */
+    retv = UP_SUCCESS;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        up_reactor_unlink(reactor, wait);
+        free(wait);
+        retv = UP_ERROR_CONF_INVAL;
+    }
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    return retv;
+#else
+    return UP_ERROR_CONF_INVAL;
+#endif
+}
+
+/* Register a producer and give it a free lane. */
+int up_pool_producer_register(up_pool_t *pool, up_producer_t **producer)
+{
+    int used;
+    size_t i, count;
+    up_ring_t *ring;
+    up_producer_t *lane;
+
+    for (i = 0; i < UP_LANES_MAX; i++) {
+        lane = &pool->lanes[i];
+
+        used = 0;
+        if (!__atomic_compare_exchange_n(&lane->used, &used, 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        if (lane->ring == NULL) {
+            ring = up_ring_create(UP_LANE_SIZE);
+            if (ring == NULL) {
+                __atomic_store_n(&lane->used, 0, __ATOMIC_RELEASE);
+                up_handle_error("up_pool_producer_register:up_ring_create", UP_ERROR_MALLOC);
+            }
+
+            __atomic_store_n(&lane->ring, ring, __ATOMIC_RELEASE);
+        }
+
+        count = __atomic_load_n(&pool->lane_count, __ATOMIC_RELAXED);
+        while (count <= i &&
+               !__atomic_compare_exchange_n(&pool->lane_count, &count, i + 1, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) { }
+
+        *producer = lane;
+
+        return UP_SUCCESS;
+    }
+
+    return UP_ERROR_CONF_INVAL;
+}
+
+/* Give the producer's lane back to the pool. */
+int up_pool_producer_unregister(up_producer_t *producer)
+{
+    __atomic_store_n(&producer->used, 0, __ATOMIC_RELEASE);
+
+    return UP_SUCCESS;
+}
+
+/* Submit a new task to the producer's lane.
+ *
+ * Only the producer pushes to its lane, so the push never contends. A
+ * full lane falls back to the pool's queue.
+ */
+int up_producer_submit(up_producer_t *producer, void (*task_routine) (void *), void *arg)
+{
+    up_task_t task;
+    up_pool_t *pool = producer->pool;
+
+    task.task_routine = task_routine;
+    task.arg = arg;
+    task.stamp = up_pool_stamp(pool);
+
+    __atomic_add_fetch(&pool->inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (up_pool_closed(pool)) {
+        up_pool_done_n(pool, 1);
+        return UP_ERROR_SHUTDOWN;
+    }
+
+    if (!up_ring_push(producer->ring, &task)) {
+        return up_pool_submit_counted(pool, &task,
+                                      __atomic_load_n(&pool->full_policy, __ATOMIC_RELAXED),
+                                      NULL);
+    }
+
+    up_pool_wake(pool);
+
+    return UP_SUCCESS;
+}
+
+/* Return the strand of `key`. */
+static size_t up_strand_index(unsigned long key)
+{
+    key ^= key >> 17;
+    key *= 0xed5ad4bbUL;
+    key ^= key >> 11;
+
+    return (size_t) (key & (UP_STRANDS - 1));
+}
+
+/* Return the pool's strands, allocating them on first use. */
+static up_strand_t *up_pool_strands(up_pool_t *pool)
+{
+    size_t i;
+    up_strand_t *strands, *expected = NULL;
+
+    strands = __atomic_load_n(&pool->strands, __ATOMIC_ACQUIRE);
+    if (strands != NULL) {
+        return strands;
+    }
+
+    strands = (up_strand_t *) malloc(UP_STRANDS * sizeof(up_strand_t));
+    if (strands == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < UP_STRANDS; i++) {
+        up_queue_init(&strands[i].queue);
+        strands[i].pending = 0;
+        strands[i].pool = pool;
+    }
+
+    if (!__atomic_compare_exchange_n(&pool->strands, &expected, strands, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < UP_STRANDS; i++) {
+            pthread_mutex_destroy(&strands[i].queue.lock);
+        }
+        free(strands);
+
+        return expected;
+    }
+
+    return strands;
+}
+
+/* Run the tasks of a strand in order.
+ *
+ * The task that brings `strand->pending` from 0 to 1 submits the drain,
+ * which runs tasks until it brings it back to 0, so one drain at most
+ * runs per strand. A task is queued before it's counted, so a pending
+ * one is always found. After `UP_STRAND_BATCH` tasks the drain goes on
+ * from the queue of the worker's node, behind the other queued tasks.
+ */
+static void up_strand_drain(void *arg)
+{
+    size_t i;
+    up_task_t task;
+    up_strand_t *strand = (up_strand_t *) arg;
+    up_pool_t *pool = strand->pool;
+    up_worker_t *worker = up_pool_current_worker(pool);
+
+    for (i = 0; i < UP_STRAND_BATCH; i++) {
+        up_queue_deq(&strand->queue, &task);
+
+        up_pool_execute(pool, worker, &task);
+
+        if (__atomic_sub_fetch(&strand->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            return;
+        }
+    }
+
+    task.task_routine = up_strand_drain;
+    task.arg = arg;
+    task.stamp = 0;
+
+    __atomic_add_fetch(&pool->inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (up_queue_enq(&pool->domains[worker->domain].queue, &task) != UP_SUCCESS) {
+        up_pool_done_n(pool, 1);
+        return;
+    }
+
+    up_pool_wake(pool);
+}
+
+/* Submit a new task to the strand of `key`. */
+int up_pool_submit_keyed(up_pool_t *pool, unsigned long key,
+                         void (*task_routine) (void *), void *arg)
+{
+    int retv;
+    up_task_t task;
+    up_strand_t *strands, *strand;
+
+    strands = up_pool_strands(pool);
+    if (strands == NULL) {
+        up_handle_error("up_pool_submit_keyed:malloc", UP_ERROR_MALLOC);
+    }
+
+    strand = &strands[up_strand_index(key)];
+
+    task.task_routine = task_routine;
+    task.arg = arg;
+    task.stamp = up_pool_stamp(pool);
+
+    __atomic_add_fetch(&pool->inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (up_pool_closed(pool)) {
+        up_pool_done_n(pool, 1);
+        return UP_ERROR_SHUTDOWN;
+    }
+
+    retv = up_queue_enq(&strand->queue, &task);
+    if (retv != UP_SUCCESS) {
+        up_pool_done_n(pool, 1);
+        return retv;
+    }
+
+    if (__atomic_fetch_add(&strand->pending, 1, __ATOMIC_ACQ_REL) != 0) {
+        return UP_SUCCESS;
+    }
+
+    task.task_routine = up_strand_drain;
+    task.arg = (void *) strand;
+    task.stamp = 0;
+
+    return up_pool_submit_task(pool, &task, UP_POLICY_BLOCK, NULL);
+}
+
+/* Create a task group served in proportion to `weight`. */
+int up_pool_group_create(up_pool_t *pool, size_t weight, up_group_t **group)
+{
+    size_t i;
+    up_group_t *g;
+
+    if (weight == 0) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    pthread_mutex_lock(&pool->group_lock);
+
+    /* Slots of destroyed groups are reused once their tasks are taken. */
+    for (i = 0; i < UP_GROUPS_MAX; i++) {
+        g = &pool->groups[i];
+        if (g->used || __atomic_load_n(&g->queue.size, __ATOMIC_ACQUIRE) > 0) {
+            continue;
+        }
+
+        __atomic_store_n(&g->used, 1, __ATOMIC_RELEASE);
+        g->weight = weight;
+        g->deficit = 0;
+
+        if (pool->group_count <= i) {
+            pool->group_count = i + 1;
+        }
+
+        pthread_mutex_unlock(&pool->group_lock);
+
+        *group = g;
+
+        return UP_SUCCESS;
+    }
+
+    pthread_mutex_unlock(&pool->group_lock);
+
+    return UP_ERROR_CONF_INVAL;
+}
+
+/* Give the group back to the pool. */
+int up_pool_group_destroy(up_group_t *group)
+{
+    up_pool_t *pool = group->pool;
+
+    pthread_mutex_lock(&pool->group_lock);
+    __atomic_store_n(&group->used, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->group_lock);
+
+    return UP_SUCCESS;
+}
+
+/* Submit a new task to the group's queue. */
+int up_group_submit(up_group_t *group, void (*task_routine) (void *), void *arg)
+{
+    int retv;
+    up_task_t task;
+    up_pool_t *pool = group->pool;
+
+    if (!__atomic_load_n(&group->used, __ATOMIC_ACQUIRE)) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    task.task_routine = task_routine;
+    task.arg = arg;
+    task.stamp = up_pool_stamp(pool);
+
+    __atomic_add_fetch(&pool->inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (up_pool_closed(pool)) {
+        up_pool_done_n(pool, 1);
+        return UP_ERROR_SHUTDOWN;
+    }
+
+    /* Counted before it's queued, so that a take never drops the count
+     * below the number of queued tasks. */
+    __atomic_add_fetch(&pool->group_queued, 1, __ATOMIC_SEQ_CST);
+
+    retv = up_queue_enq(&group->queue, &task);
+    if (retv != UP_SUCCESS) {
+        __atomic_sub_fetch(&pool->group_queued, 1, __ATOMIC_SEQ_CST);
+        up_pool_done_n(pool, 1);
+        return retv;
+    }
+
+    up_pool_wake(pool);
+
+    return UP_SUCCESS;
+}
+
+/* Drop a reference to the token, freeing it if it was the last one. */
+static void up_token_put(up_token_t *token)
+{
+    up_pool_t *pool = token->pool;
+
+    if (__atomic_sub_fetch(&token->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->token_lock);
+
+    if (token->prev != NULL) {
+        token->prev->next = token->next;
+    } else {
+        pool->tokens = token->next;
+    }
+
+    if (token->next != NULL) {
+        token->next->prev = token->prev;
+    }
+
+    pthread_mutex_unlock(&pool->token_lock);
+
+    free(token);
+}
+
+/* Run the task whose token, routine and arg are in `data`, or, once the
+ * token is cancelled, skip it and call the token's cleanup instead. */
+static void up_token_run(void *data)
+{
+    up_token_entry_t entry;
+    up_token_t *token;
+    up_worker_t *worker;
+
+    memcpy(&entry, data, sizeof(up_token_entry_t));
+    token = entry.token;
+
+    if (!__atomic_load_n(&token->cancelled, __ATOMIC_ACQUIRE)) {
+        entry.task_routine(entry.arg);
+    } else {
+        if (token->cleanup != NULL) {
+            token->cleanup(entry.arg);
+        }
+
+        /* Out of the pool the statistics are shared. */
+        worker = up_pool_current_worker(token->pool);
+        if (worker != NULL) {
+            up_stat_add(worker->stats.cancelled, 1);
+            worker->skipped = 1;
+        } else {
+            __atomic_add_fetch(&token->pool->ext_stats.cancelled, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    up_token_put(token);
+}
+
+/* Create a new cancellation token. */
+int up_pool_token_create(up_pool_t *pool, void (*cleanup) (void *), up_token_t **token)
+{
+    up_token_t *t;
+
+    t = (up_token_t *) malloc(sizeof(up_token_t));
+    if (t == NULL) {
+        up_handle_error("up_pool_token_create:malloc", UP_ERROR_MALLOC);
+    }
+
+    t->cancelled = 0;
+    t->refs = 1;
+    t->cleanup = cleanup;
+    t->pool = pool;
+    t->prev = NULL;
+
+    pthread_mutex_lock(&pool->token_lock);
+
+    t->next = pool->tokens;
+    if (t->next != NULL) {
+        t->next->prev = t;
+    }
+    pool->tokens = t;
+
+    pthread_mutex_unlock(&pool->token_lock);
+
+    *token = t;
+
+    return UP_SUCCESS;
+}
+
+/* Submit a new task skipped if `token` is cancelled before it runs. */
+int up_pool_submit_token(up_pool_t *pool, up_token_t *token,
+                         void (*task_routine) (void *), void *arg)
+{
+    int retv;
+    up_task_t task;
+    up_token_entry_t entry;
+
+    entry.token = token;
+    entry.task_routine = task_routine;
+    entry.arg = arg;
+
+    task.task_routine = up_token_run;
+    task.arg = UP_INLINE_ARG;
+    task.stamp = up_pool_stamp(pool);
+
+    memcpy(task.data.bytes, &entry, sizeof(up_token_entry_t));
+
+    __atomic_add_fetch(&token->refs, 1, __ATOMIC_RELAXED);
+
+    retv = up_pool_submit_task(pool, &task,
+                               __atomic_load_n(&pool->full_policy, __ATOMIC_RELAXED), NULL);
+    if (retv != UP_SUCCESS) {
+        up_token_put(token);
+    }
+
+    return retv;
+}
+
+/* Cancel the tasks of the token not started yet. */
+int up_pool_cancel(up_token_t *token)
+{
+    __atomic_store_n(&token->cancelled, 1, __ATOMIC_RELEASE);
+
+    return UP_SUCCESS;
+}
+
+/* Release the token. */
+int up_token_release(up_token_t *token)
+{
+    up_token_put(token);
+
+    return UP_SUCCESS;
+}
+
+/* Submit a new task to run on a fiber. */
+int up_pool_submit_fiber(up_pool_t *pool, void (*task_routine) (void *), void *arg)
+{
+    up_task_t task;
+    up_fiber_entry_t entry;
+
+    entry.task_routine = task_routine;
+    entry.arg = arg;
+
+    task.task_routine = up_fiber_launch;
+    task.arg = UP_INLINE_ARG;
+    task.stamp = up_pool_stamp(pool);
+
+    memcpy(task.data.bytes, &entry, sizeof(up_fiber_entry_t));
+
+    return up_pool_submit_task(pool, &task,
+                               __atomic_load_n(&pool->full_policy, __ATOMIC_RELAXED), NULL);
+}
+
+/* Submit a new task with a copy of its arg. */
+int up_pool_submit_copy(up_pool_t *pool, void (*task_routine) (void *), const void *data,
+                        size_t len)
+{
+    up_task_t task;
+
+    if (len > UP_INLINE_SIZE) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    task.task_routine = task_routine;
+    task.arg = UP_INLINE_ARG;
+    task.stamp = up_pool_stamp(pool);
+
+    memcpy(task.data.bytes, data, len);
+
+    return up_pool_submit_task(pool, &task,
+                               __atomic_load_n(&pool->full_policy, __ATOMIC_RELAXED), NULL);
+}
+
+/* Submit a new task to the queue of priority level `prio`. */
+int up_pool_submit_prio(up_pool_t *pool, void (*task_routine) (void *), void *arg,
+                        int prio)
+{
+    int retv;
+    up_task_t task;
+
+    if (prio < UP_PRIO_LOW || prio > UP_PRIO_HIGH) {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    if (prio == UP_PRIO_NORMAL) {
+        return up_pool_submit(pool, task_routine, arg);
+    }
+
+    task.task_routine = task_routine;
+    task.arg = arg;
+    task.stamp = up_pool_stamp(pool);
+
+    __atomic_add_fetch(&pool->inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (up_pool_closed(pool)) {
+        up_pool_done_n(pool, 1);
+        return UP_ERROR_SHUTDOWN;
+    }
+
+    retv = up_queue_enq(&pool->levels[prio].queue, &task);
+    if (retv != UP_SUCCESS) {
+        up_pool_done_n(pool, 1);
+        return retv;
+    }
+
+    up_pool_wake(pool);
+
+    return UP_SUCCESS;
+}
+
+/* Return the index of the NUMA node the caller runs on. */
+static size_t up_pool_local_domain(up_pool_t *pool)
+{
+    up_worker_t *worker;
+#ifdef __linux__
+    int cpu;
+#endif
+
+    worker = up_pool_current_worker(pool);
+    if (worker != NULL) {
+        return worker->domain;
+    }
+
+#ifdef __linux__
+    cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+        return (size_t) pool->cpu_domain[cpu];
+    }
+#endif
+
+    return 0;
+}
+
+/* Submit a new task to the queue of a NUMA node. */
+int up_pool_submit_node(up_pool_t *pool, void (*task_routine) (void *), void *arg,
+                        int node)
+{
+    int retv;
+    size_t d;
+    up_task_t task;
+
+    if (node == UP_NODE_LOCAL) {
+        d = up_pool_local_domain(pool);
+    } else if (node >= 0 && (size_t) node < pool->domain_count) {
+        d = (size_t) node;
+    } else {
+        return UP_ERROR_CONF_INVAL;
+    }
+
+    task.task_routine = task_routine;
+    task.arg = arg;
+    task.stamp = up_pool_stamp(pool);
+
+    __atomic_add_fetch(&pool->inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (up_pool_closed(pool)) {
+        up_pool_done_n(pool, 1);
+        return UP_ERROR_SHUTDOWN;
+    }
+
+    retv = up_queue_enq(&pool->domains[d].queue, &task);
+    if (retv != UP_SUCCESS) {
+        up_pool_done_n(pool, 1);
+        return retv;
+    }
+
+    up_pool_wake(pool);
+
+    return UP_SUCCESS;
+}
+
+/* Submit `n` new tasks to the pool's queue.
  *
- * A new `up_node_t` is allocated, the `task` is copied into the
- * new `node` and then the `node` is attached at the `pool->tail`
- * of the task queue. Finally, the `pool->cond` is signaled so
- * that one consumer thread waiting on `pool->cond` can wake up
- * and consume the new task.
+ * Tasks go to the worker's deque when called from a task, else to the
+ * bounded or unbounded queue. Consumers are woken up once for the batch.
  */
-static int up_pool_enq(up_pool_t *pool, up_task_t *task)
+int up_pool_submit_batch(up_pool_t *pool, void (*task_routines[]) (void *), void *args[],
+                         size_t n)
 {
     int retv;
-    up_node_t *node;
+    size_t i, w;
+    up_task_t task;
+    up_worker_t *worker;
 
-    node = (up_node_t *) malloc(sizeof(up_node_t));
-    if (node == NULL) {
-        up_handle_error("up_pool_enq:malloc", UP_ERROR_MALLOC);
+    if (n == 0) {
+        return UP_SUCCESS;
     }
 
-    memcpy((void *) &node->task, (const void *) task, sizeof(up_task_t));
-    node->next = NULL;
+    __atomic_add_fetch(&pool->inflight, n, __ATOMIC_SEQ_CST);
 
-    retv = pthread_mutex_lock(&pool->enq_lock);
-    if (retv != 0) {
-        free(node);
-        up_handle_error_en("up_pool_enq:pthread_mutex_lock", retv, UP_ERROR_MUTEX_LOCK);
+    if (up_pool_closed(pool)) {
+        up_pool_done_n(pool, n);
+        return UP_ERROR_SHUTDOWN;
     }
 
-    pool->tail->next = node;
-    pool->tail = node;
+    worker = up_pool_current_worker(pool);
+    if (worker == NULL && pool->ring == NULL) {
+        retv = up_pool_enq_batch(pool, task_routines, args, n);
+        if (retv != UP_SUCCESS) {
+            up_pool_done_n(pool, n);
+        }
+
+        return retv;
+    }
 
-    pool->enq_count += 1;
+    task.stamp = up_pool_stamp(pool);
 
-    retv = pthread_mutex_unlock(&pool->enq_lock);
-    if (retv != 0) {
-        up_handle_error("up_pool_enq:pthread_mutex_unlock", UP_ERROR_MUTEX_LOCK);
+    for (i = 0, w = 0; i < n; i++) {
+        task.task_routine = task_routines[i];
+        task.arg = args[i];
+
+        if (worker != NULL) {
+            retv = up_deque_push(&worker->deque, &task);
+            if (retv != UP_SUCCESS) {
+                up_pool_done_n(pool, n - i);
+                return retv;
+            }
+        } else if (up_ring_push(pool->ring, &task)) {
+            __atomic_add_fetch(&pool->enq_count, 1, __ATOMIC_RELAXED);
+        } else {
+            /* The ring is full, wake up consumers for the tasks pushed so
+             * far and apply the full queue policy to this one. */
+            up_pool_wake_n(pool, i - w);
+
+            w = i + 1;
+
+            retv = up_pool_submit_counted(pool, &task,
+                                          __atomic_load_n(&pool->full_policy, __ATOMIC_RELAXED),
+                                          NULL);
+            if (retv != UP_SUCCESS) {
+                up_pool_done_n(pool, n - w);
+                return retv;
+            }
+        }
     }
 
-    pthread_cond_signal(&pool->cond);
+    up_pool_wake_n(pool, n - w);
 
     return UP_SUCCESS;
 }
 
-/* Dequeue a task from the pool's queue.
- *
- * The dequeued `pool->head->task` is copied to `task` and then the
- * `pool->head` node is freed.
- */
-static int up_pool_deq(up_pool_t *pool, up_task_t *task)
+/* Return the number of enqueued tasks (not yet executed), wait-free. */
+int up_pool_queue_size(up_pool_t *pool, size_t *size)
 {
-    int retv;
-    up_node_t *old_head;
+    size_t i, d;
 
-    retv = pthread_mutex_lock(&pool->deq_lock);
-    if (retv != 0) {
-        up_handle_error("up_pool_deq:pthread_mutex_lock", UP_ERROR_MUTEX_LOCK);
+    for (d = 0, i = 0; i < pool->thread_count; i++) {
+        d += up_deque_size(&pool->workers[i].deque);
+    }
+
+    for (i = 0; i < pool->domain_count; i++) {
+        d += __atomic_load_n(&pool->domains[i].queue.size, __ATOMIC_RELAXED);
     }
 
-    pool->deq_count += 1;
+    d += __atomic_load_n(&pool->levels[UP_PRIO_HIGH].queue.size, __ATOMIC_RELAXED);
+    d += __atomic_load_n(&pool->levels[UP_PRIO_LOW].queue.size, __ATOMIC_RELAXED);
+    d += __atomic_load_n(&pool->group_queued, __ATOMIC_RELAXED);
+
+    *size = up_pool_depth(pool) + d;
+
+    return UP_SUCCESS;
+}
+
+/* Block until all the submitted tasks have completed.
+ *
+ * The caller registers in `pool->quiescent_waiters` and sleeps on the
+ * `pool->quiescent_seq` futex, see `up_pool_done_n`.
+ */
+static int up_pool_wait_quiescent(up_pool_t *pool, const struct timespec *abstime)
+{
+    int seq, retv;
 
-    while (pool->head->next == NULL) {
-        /* If the queue is empty block until a producer thread enqueues
-         * a task and signals the condition.
-         *
-         * This is the only Cancellation Point of a consumer thread.
-         * From here it's safe to jump to `up_pool_worker_cleanup`. */
-        pthread_cond_wait(&pool->cond, &pool->deq_lock);
+    if (up_pool_current_worker(pool) != NULL) {
+        return UP_ERROR_DEADLOCK;
     }
 
-    old_head = pool->head;
+    retv = UP_SUCCESS;
 
-    pool->head = pool->head->next;
+    __atomic_add_fetch(&pool->quiescent_waiters, 1, __ATOMIC_SEQ_CST);
 
-    memcpy((void *) task, (const void *) &pool->head->task, sizeof(up_task_t));
+    for ( ;; ) {
+        seq = __atomic_load_n(&pool->quiescent_seq, __ATOMIC_SEQ_CST);
 
-    memset((void *) &pool->head->task, 0, sizeof(up_task_t));
+        if (__atomic_load_n(&pool->inflight, __ATOMIC_SEQ_CST) == 0) {
+            break;
+        }
 
-    retv = pthread_mutex_unlock(&pool->deq_lock);
-    if (retv != 0) {
-        up_handle_error("up_pool_deq:pthread_mutex_unlock", UP_ERROR_MUTEX_LOCK);
+        if (up_futex_wait(&pool->quiescent_seq, seq, abstime) == ETIMEDOUT) {
+            if (__atomic_load_n(&pool->inflight, __ATOMIC_SEQ_CST) != 0) {
+                retv = UP_ERROR_TIMEDOUT;
+            }
+            break;
+        }
     }
 
-    free(old_head);
+    __atomic_sub_fetch(&pool->quiescent_waiters, 1, __ATOMIC_SEQ_CST);
 
-    return UP_SUCCESS;
+    return retv;
+}
+
+/* Block until all the submitted tasks have completed. */
+int up_pool_wait(up_pool_t *pool)
+{
+    return up_pool_wait_quiescent(pool, NULL);
 }
 
-/* Do thread cleanup on cancellation.
+/* Block until all the submitted tasks have completed or `abstime` passes. */
+int up_pool_wait_timed(up_pool_t *pool, const struct timespec *abstime)
+{
+    return up_pool_wait_quiescent(pool, abstime);
+}
+
+/* Set a completion flag and wake up the threads waiting for it.
  *
- * Since a consumer thread is cancellable only when it's blocked in
- * `pthread_cond_wait`, when the cleanup code is executed the
- * `pool->deq_lock` is acquired and should be released.
+ * Waiters register in `waiters` before re-checking `done`, so they are
+ * woken up only if there are any.
  */
-static void up_pool_worker_cleanup(void *arg)
+static void up_flag_set(int *done, size_t *waiters)
 {
-    int retv;
-    up_pool_t *pool = (up_pool_t *) arg;
+    __atomic_store_n(done, 1, __ATOMIC_SEQ_CST);
 
-    retv = pthread_mutex_unlock(&pool->deq_lock);
-    if (retv != 0) {
-        perror("up_pool_worker_cleanup:pthread_mutex_unlock");
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0) {
+        up_futex_wake(done, INT_MAX);
     }
 }
 
-/* Dequeue a task from the pool's queue and execute it.
+/* Block until `done` is set.
  *
- * This function blocks while trying to `up_pool_deq` a task from the queue.
- * When a dequeue is successfull the task's routine is executed. While the
- * task is running the thread's cancel state is set to `disabled` to ensure
- * the execution of all the client code.
+ * When called from a task of the same pool the worker keeps executing
+ * other tasks, possibly the awaited ones, instead of blocking right away.
+ * From a fiber, the fiber is hidden meanwhile, so that only its own
+ * routine can park it.
  */
-static void *up_pool_worker(void *arg)
+static void up_flag_wait(up_pool_t *pool, int *done, size_t *waiters)
 {
-    int retv;
-    up_pool_t *pool = (up_pool_t *) arg;
+    up_task_t task;
+    up_worker_t *worker;
+    up_fiber_t *fiber;
 
-    pthread_cleanup_push(up_pool_worker_cleanup, arg);
+    worker = up_pool_current_worker(pool);
+    if (worker != NULL) {
+        fiber = worker->fiber;
+        worker->fiber = NULL;
 
-    for ( ;; ) {
-        up_task_t task;
+        while (!__atomic_load_n(done, __ATOMIC_ACQUIRE)) {
+            if (up_pool_take(pool, worker, &task) == UP_SUCCESS) {
+                up_pool_execute(pool, worker, &task);
+                worker = up_worker_self();
+            } else if (!up_pool_run_ready(pool, worker)) {
+                break;
+            }
+        }
 
-        retv = up_pool_deq(pool, &task);
-        if (retv != UP_SUCCESS) {
-            perror("up_pool_worker:up_pool_deq");
-            pthread_exit(NULL);
+        worker->fiber = fiber;
+    }
+
+    if (!__atomic_load_n(done, __ATOMIC_ACQUIRE)) {
+        __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+
+        while (!__atomic_load_n(done, __ATOMIC_SEQ_CST)) {
+            up_futex_wait(done, 0, NULL);
         }
 
-        /* Disable and then re-enable cancel state in order to ensure
-         * `task.task_routine`'s execution. */
-        retv = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-        if (retv != 0) {
-            perror("up_pool_worker: Could not disable cancel state.");
+        __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* Take a handle from the pool's free list, allocating a new slab of
+ * handles when the list is empty. */
+static up_task_handle_t *up_handle_alloc(up_pool_t *pool)
+{
+    size_t i;
+    up_handle_slab_t *slab;
+    up_task_handle_t *handle;
+
+    if (pthread_mutex_lock(&pool->handle_lock) != 0) {
+        return NULL;
+    }
+
+    if (pool->free_handles == NULL) {
+        slab = (up_handle_slab_t *) malloc(sizeof(up_handle_slab_t));
+        if (slab == NULL) {
+            pthread_mutex_unlock(&pool->handle_lock);
+            return NULL;
         }
 
-        task.task_routine(task.arg);
+        slab->next = pool->handle_slabs;
+        pool->handle_slabs = slab;
 
-        retv = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-        if (retv != 0) {
-            perror("up_pool_worker: Could not enable cancel state.");
-            pthread_exit(NULL);
+        for (i = 0; i < UP_HANDLE_SLAB; i++) {
+            slab->handles[i].next = pool->free_handles;
+            pool->free_handles = &slab->handles[i];
         }
     }
 
-    pthread_cleanup_pop(1);
+    handle = pool->free_handles;
+    pool->free_handles = handle->next;
 
-    return NULL;
+    pthread_mutex_unlock(&pool->handle_lock);
+
+    return handle;
 }
 
-/* Create a new thread pool.
- *
- * After allocating resources the threads are beeing created.
- */
-int up_pool_create(up_pool_t **pool, size_t n)
+/* Drop a reference to the handle, recycling it if it was the last one. */
+static void up_handle_put(up_task_handle_t *handle)
 {
-    int retv;
-    size_t i, t;
-    up_pool_t *p;
+    up_pool_t *pool = handle->pool;
 
-    if (n < 1) {
-        return UP_ERROR_CONF_INVAL;
+    if (__atomic_sub_fetch(&handle->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
     }
 
-    p = (up_pool_t *) malloc(sizeof(up_pool_t));
-    if (p == NULL) {
-        up_handle_error("up_pool_create:malloc", UP_ERROR_MALLOC);
-    }
+    pthread_mutex_lock(&pool->handle_lock);
 
-    *pool = p;
+    handle->next = pool->free_handles;
+    pool->free_handles = handle;
 
-    p->thread_count = n;
+    pthread_mutex_unlock(&pool->handle_lock);
+}
 
-    p->enq_count = 0;
-    p->deq_count = 0;
+static void up_handle_run(void *arg);
 
-    p->threads = (pthread_t *) malloc(n * sizeof(pthread_t));
-    if (p->threads == NULL) {
-        up_handle_error("up_pool_create:malloc", UP_ERROR_MALLOC);
+/* Count a completed dependency of `handle`, return non zero if it was the
+ * last one. The edges are freed then, no one reads them anymore. */
+static int up_handle_resolve(up_task_handle_t *handle)
+{
+    if (__atomic_sub_fetch(&handle->pending, 1, __ATOMIC_ACQ_REL) != 0) {
+        return 0;
     }
 
-    pthread_cond_init(&p->cond, NULL);
+    free(handle->edges);
+    handle->edges = NULL;
 
-    pthread_mutex_init(&p->enq_lock, NULL);
-    pthread_mutex_init(&p->deq_lock, NULL);
+    return 1;
+}
 
-    p->head = (up_node_t *) calloc(1, sizeof(up_node_t));
-    if (p->head == NULL) {
-        up_handle_error("up_pool_create:calloc", UP_ERROR_MALLOC);
-    }
+/* Complete the task of a handle and resolve its successors.
+ *
+ * The first ready successor is returned to be run inline by the caller,
+ * the others are submitted, to the caller's deque if it is a worker.
+ */
+static up_task_handle_t *up_handle_complete(up_task_handle_t *handle)
+{
+    up_edge_t *edge, *next;
+    up_task_handle_t *task, *inline_task = NULL;
 
-    p->tail = p->head;
+    up_flag_set(&handle->done, &handle->waiters);
 
-    for (i = 0; i < n; i++) {
-        retv = pthread_create(&p->threads[i], NULL, up_pool_worker, p);
-        if (retv != 0) {
-            up_handle_error("up_pool_create:pthread_create", UP_ERROR_THREAD_CREATE);
+    edge = __atomic_exchange_n(&handle->succs, UP_SUCCS_CLOSED, __ATOMIC_ACQ_REL);
+
+    for ( ; edge != NULL; edge = next) {
+        next = edge->next;
+        task = edge->task;
+
+        if (!up_handle_resolve(task)) {
+            continue;
         }
-    }
 
-    do {
-        retv = pthread_mutex_lock(&p->deq_lock);
-        if (retv != 0) {
-            up_handle_error("up_pool_create:pthread_mutex_lock", UP_ERROR_MUTEX_LOCK);
+        if (inline_task == NULL) {
+            inline_task = task;
+        } else if (up_pool_submit(task->pool, up_handle_run, (void *) task) != UP_SUCCESS) {
+            up_handle_put(task);
         }
+    }
 
-        t = p->deq_count;
+    return inline_task;
+}
 
-        retv = pthread_mutex_unlock(&p->deq_lock);
-        if (retv != 0) {
-            up_handle_error("up_pool_create:pthread_mutex_unlock", UP_ERROR_MUTEX_LOCK);
-        }
-    } while (t != n);
+/* Run the routine of a task with a handle and publish its result, then
+ * go on with a successor it made ready, if any. */
+static void up_handle_run(void *arg)
+{
+    up_task_handle_t *next, *handle = (up_task_handle_t *) arg;
 
-    p->deq_count = 0;
+    while (handle != NULL) {
+        handle->result = handle->task_routine(handle->arg);
 
-    return UP_SUCCESS;
+        next = up_handle_complete(handle);
+
+        up_handle_put(handle);
+
+        handle = next;
+    }
 }
 
-/* Destroy the thread pool.
+/* Submit a new task and return a handle to wait for its result. */
+int up_pool_submit_handle(up_pool_t *pool, void *(*task_routine) (void *), void *arg,
+                          up_task_handle_t **handle)
+{
+    return up_pool_submit_after(pool, NULL, 0, task_routine, arg, handle);
+}
+
+/* Submit a new task to run once the tasks of `deps` have completed.
  *
- * First try to `pthread_cancel` all the threads and then `pthread_join`
- * them to ensure they have terminated. Then release allocated resources.
+ * The task's `pending` count starts at `n` plus one for the caller, so
+ * it can't become ready until all the edges are added. An edge pushed
+ * onto the successors of a dependency is resolved by whoever completes
+ * it, a dependency already completed is resolved right away.
  */
-int up_pool_destroy(up_pool_t *pool)
+int up_pool_submit_after(up_pool_t *pool, up_task_handle_t *deps[], size_t n,
+                         void *(*task_routine) (void *), void *arg,
+                         up_task_handle_t **handle)
 {
     int retv;
     size_t i;
-    up_node_t *c, *t;
+    up_edge_t *edge, *head;
+    up_task_handle_t *h;
 
-    for (i = 0; i < pool->thread_count; i++) {
-        retv = pthread_cancel(pool->threads[i]);
-        if (retv != 0) {
-            perror("up_pool_destroy:pthread_cancel");
+    h = up_handle_alloc(pool);
+    if (h == NULL) {
+        up_handle_error("up_pool_submit_after:up_handle_alloc", UP_ERROR_MALLOC);
+    }
+
+    h->task_routine = task_routine;
+    h->arg = arg;
+    h->result = NULL;
+    h->done = 0;
+    h->waiters = 0;
+    h->refs = handle != NULL ? 2 : 1;
+    h->pending = n + 1;
+    h->succs = NULL;
+    h->edges = NULL;
+    h->pool = pool;
+
+    if (n > 0) {
+        h->edges = (up_edge_t *) malloc(n * sizeof(up_edge_t));
+        if (h->edges == NULL) {
+            h->refs = 1;
+            up_handle_put(h);
+            up_handle_error("up_pool_submit_after:malloc", UP_ERROR_MALLOC);
         }
     }
 
-    for (i = 0; i < pool->thread_count; i++) {
-        retv = pthread_join(pool->threads[i], NULL);
-        if (retv != 0) {
-            up_handle_error("up_pool_destroy:pthread_join", UP_ERROR_THREAD_JOIN);
+    if (handle != NULL) {
+        *handle = h;
+    }
+
+    for (i = 0; i < n; i++) {
+        edge = &h->edges[i];
+        edge->task = h;
+
+        head = __atomic_load_n(&deps[i]->succs, __ATOMIC_ACQUIRE);
+        do {
+            if (head == UP_SUCCS_CLOSED) {
+                break;
+            }
+
+            edge->next = head;
+        } while (!__atomic_compare_exchange_n(&deps[i]->succs, &head, edge, 1,
+                                              __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+        if (head == UP_SUCCS_CLOSED) {
+            up_handle_resolve(h);
         }
     }
 
-    free(pool->threads);
+    if (!up_handle_resolve(h)) {
+        return UP_SUCCESS;
+    }
 
-    retv = pthread_cond_destroy(&pool->cond);
-    if (retv != 0) {
-        up_handle_error("up_pool_destroy:pthread_cond_destroy", UP_ERROR_COND_DESTROY);
+    retv = up_pool_submit(pool, up_handle_run, (void *) h);
+    if (retv != UP_SUCCESS) {
+        h->refs = 1;
+        up_handle_put(h);
+
+        if (handle != NULL) {
+            *handle = NULL;
+        }
     }
 
-    retv = pthread_mutex_destroy(&pool->enq_lock);
-    if (retv != 0) {
-        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    return retv;
+}
+
+/* Return the result of the task if it has completed. */
+int up_task_try_wait(up_task_handle_t *handle, void **result)
+{
+    if (!__atomic_load_n(&handle->done, __ATOMIC_ACQUIRE)) {
+        return UP_ERROR_PENDING;
     }
 
-    retv = pthread_mutex_destroy(&pool->deq_lock);
-    if (retv != 0) {
-        up_handle_error("up_pool_destroy:pthread_mutex_destroy", UP_ERROR_MUTEX_DESTROY);
+    if (result != NULL) {
+        *result = handle->result;
     }
 
-    for (c = pool->head; c != NULL; ) {
-        t = c;
-        c = c->next;
-        free(t);
+    return UP_SUCCESS;
+}
+
+/* Block until the task has completed and return its result.
+ *
+ * A fiber of the handle's pool is suspended instead, see
+ * `up_fiber_switch`, and waits again if resumed early.
+ */
+int up_task_wait(up_task_handle_t *handle, void **result)
+{
+    up_worker_t *worker = up_pool_current_worker(handle->pool);
+
+    if (worker != NULL && worker->fiber != NULL) {
+        while (!__atomic_load_n(&handle->done, __ATOMIC_ACQUIRE)) {
+            worker->fiber->awaited = handle;
+            up_fiber_park(worker, UP_FIBER_SUSPENDED);
+
+            worker = up_worker_self();
+        }
+    } else {
+        up_flag_wait(handle->pool, &handle->done, &handle->waiters);
     }
 
-    free(pool);
+    return up_task_try_wait(handle, result);
+}
+
+/* Release the handle. */
+int up_task_release(up_task_handle_t *handle)
+{
+    up_handle_put(handle);
 
     return UP_SUCCESS;
 }
 
-/* Submit a new task to the pool's queue. */
-int up_pool_submit(up_pool_t *pool, void (*task_routine) (void *), void *arg)
+/* Claim the next chunk of the loop's range.
+ *
+ * The chunk size shrinks with the part of the range not claimed yet
+ * (guided scheduling): the first chunks are large to amortise the claims,
+ * the last ones are small to balance the load between runners.
+ */
+static int up_loop_claim(up_loop_t *loop, size_t *begin, size_t *end)
 {
-    int retv;
-    up_task_t task;
+    size_t first, left, chunk;
 
-    task.task_routine = task_routine;
-    task.arg = arg;
+    first = __atomic_load_n(&loop->next, __ATOMIC_RELAXED);
+    do {
+        if (first >= loop->end) {
+            return 0;
+        }
 
-    retv = up_pool_enq(pool, &task);
+        left = loop->end - first;
+        chunk = left / (2 * loop->parts);
+        if (chunk < loop->grain) {
+            chunk = loop->grain;
+        }
+        if (chunk > left) {
+            chunk = left;
+        }
+    } while (!__atomic_compare_exchange_n(&loop->next, &first, first + chunk, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-    return retv;
+    *begin = first;
+    *end = first + chunk;
+
+    return 1;
 }
 
-/* Return the number of enqueued tasks (not yet executed). */
-int up_pool_queue_size(up_pool_t *pool, size_t *size)
+/* Drop a reference to the loop, freeing it if it was the last one. */
+static void up_loop_put(up_loop_t *loop)
 {
-    int retv;
+    if (__atomic_sub_fetch(&loop->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
 
-    retv = pthread_mutex_lock(&pool->enq_lock);
-    if (retv != 0) {
-        up_handle_error("up_pool_queue_size:pthread_mutex_lock", UP_ERROR_MUTEX_LOCK);
+    free(loop->accs);
+    free(loop);
+}
+
+/* Run chunks of the loop until its whole range is claimed. */
+static void up_loop_run(void *arg)
+{
+    size_t begin, end;
+    up_loop_runner_t *runner = (up_loop_runner_t *) arg;
+    up_loop_t *loop = runner->loop;
+    void *acc = loop->accs + runner->index * loop->acc_stride;
+
+    while (up_loop_claim(loop, &begin, &end)) {
+        if (loop->reduce_body != NULL) {
+            loop->reduce_body(loop->ctx, begin, end, acc);
+        } else {
+            loop->for_body(loop->ctx, begin, end);
+        }
+
+        if (__atomic_sub_fetch(&loop->remaining, end - begin, __ATOMIC_ACQ_REL) == 0) {
+            up_flag_set(&loop->done, &loop->waiters);
+        }
     }
 
-    retv = pthread_mutex_lock(&pool->deq_lock);
-    if (retv != 0) {
-        up_handle_error("up_pool_queue_size:pthread_mutex_lock", UP_ERROR_MUTEX_LOCK);
+    up_loop_put(loop);
+}
+
+/* Run a parallel loop, see `up_pool_parallel_for` and
+ * `up_pool_parallel_reduce`.
+ *
+ * One runner per worker is submitted and the caller runs one more, each
+ * runner accumulates into its own cache line aligned slot of `accs`.
+ * Runners still queued when the range is completed claim nothing.
+ */
+static int up_pool_parallel(up_pool_t *pool, size_t begin, size_t end, size_t grain,
+                            void (*for_body) (void *, size_t, size_t),
+                            void (*reduce_body) (void *, size_t, size_t, void *),
+                            void (*combine) (void *, void *, const void *),
+                            void *ctx, void *result, size_t size)
+{
+    size_t i, parts;
+    void *mem;
+    up_loop_t *loop;
+    up_worker_t *worker;
+    up_fiber_t *fiber = NULL;
+
+    if (begin >= end) {
+        return UP_SUCCESS;
     }
 
-    *size = pool->enq_count - pool->deq_count;
+    parts = pool->thread_count + 1;
 
-    retv = pthread_mutex_unlock(&pool->enq_lock);
-    if (retv != 0) {
-        up_handle_error("up_pool_queue_size:pthread_mutex_unlock", UP_ERROR_MUTEX_LOCK);
+    if (posix_memalign(&mem, UP_CACHE_LINE,
+                       sizeof(up_loop_t) + parts * sizeof(up_loop_runner_t)) != 0) {
+        up_handle_error("up_pool_parallel:posix_memalign", UP_ERROR_MALLOC);
     }
 
-    retv = pthread_mutex_unlock(&pool->deq_lock);
-    if (retv != 0) {
-        up_handle_error("up_pool_queue_size:pthread_mutex_unlock", UP_ERROR_MUTEX_LOCK);
+    loop = (up_loop_t *) mem;
+
+    loop->runners = (up_loop_runner_t *) (loop + 1);
+    loop->accs = NULL;
+    loop->acc_stride = 0;
+
+    if (reduce_body != NULL) {
+        loop->acc_stride = (size + UP_CACHE_LINE - 1) / UP_CACHE_LINE * UP_CACHE_LINE;
+
+        if (posix_memalign(&mem, UP_CACHE_LINE, parts * loop->acc_stride) != 0) {
+            free(loop);
+            up_handle_error("up_pool_parallel:posix_memalign", UP_ERROR_MALLOC);
+        }
+
+        loop->accs = (char *) mem;
+
+        for (i = 0; i < parts; i++) {
+            memcpy(loop->accs + i * loop->acc_stride, result, size);
+        }
+    }
+
+    for (i = 0; i < parts; i++) {
+        loop->runners[i].loop = loop;
+        loop->runners[i].index = i;
+    }
+
+    loop->next = begin;
+    loop->remaining = end - begin;
+    loop->end = end;
+    loop->grain = grain > 0 ? grain : 1;
+    loop->parts = parts;
+    loop->for_body = for_body;
+    loop->reduce_body = reduce_body;
+    loop->ctx = ctx;
+    loop->done = 0;
+    loop->waiters = 0;
+    loop->refs = parts + 1;
+
+    /* The first runner is left for the caller. */
+    for (i = 1; i < parts; i++) {
+        if (up_pool_submit(pool, up_loop_run, (void *) &loop->runners[i]) != UP_SUCCESS) {
+            __atomic_sub_fetch(&loop->refs, parts - i, __ATOMIC_ACQ_REL);
+            break;
+        }
     }
 
+    /* Bodies never park the caller's fiber, as on the other workers. */
+    worker = up_worker_self();
+    if (worker != NULL) {
+        fiber = worker->fiber;
+        worker->fiber = NULL;
+    }
+
+    up_loop_run((void *) &loop->runners[0]);
+
+    up_flag_wait(pool, &loop->done, &loop->waiters);
+
+    if (worker != NULL) {
+        worker->fiber = fiber;
+    }
+
+    if (reduce_body != NULL) {
+        for (i = 0; i < parts; i++) {
+            combine(ctx, result, loop->accs + i * loop->acc_stride);
+        }
+    }
+
+    up_loop_put(loop);
+
     return UP_SUCCESS;
 }
+
+/* Call `body` on chunks of [begin, end) in parallel. */
+int up_pool_parallel_for(up_pool_t *pool, size_t begin, size_t end, size_t grain,
+                         void (*body) (void *, size_t, size_t), void *ctx)
+{
+    return up_pool_parallel(pool, begin, end, grain, body, NULL, NULL, ctx, NULL, 0);
+}
+
+/* Reduce [begin, end) in parallel into `result`. */
+int up_pool_parallel_reduce(up_pool_t *pool, size_t begin, size_t end, size_t grain,
+                            void (*body) (void *, size_t, size_t, void *),
+                            void (*combine) (void *, void *, const void *),
+                            void *ctx, void *result, size_t size)
+{
+    return up_pool_parallel(pool, begin, end, grain, NULL, body, combine, ctx, result, size);
+}
@@ -18,6 +18,9 @@
 #ifndef __UPOOL_H__
 #define __UPOOL_H__
 
+#include <stddef.h>
+#include <time.h>
+
 #define UP_SUCCESS 0
 #define UP_ERROR_MALLOC -1
 #define UP_ERROR_THREAD_CREATE -2
@@ -27,20 +30,398 @@
 #define UP_ERROR_MUTEX_DESTROY -6
 #define UP_ERROR_COND_DESTROY -7
 #define UP_ERROR_CONF_INVAL -8
+#define UP_ERROR_QUEUE_FULL -9
+#define UP_ERROR_TIMEDOUT -10
+#define UP_ERROR_DEADLOCK -11
+#define UP_ERROR_PENDING -12
+#define UP_ERROR_SHUTDOWN -13
+
+/* How `up_pool_shutdown` treats the queued tasks. */
+#define UP_SHUTDOWN_DRAIN 1               /* Run them, then exit. */
+#define UP_SHUTDOWN_DISCARD 2             /* Drop them, exit after the running ones. */
+
+/* What a bounded pool does when a task is submitted to a full queue. */
+#define UP_POLICY_BLOCK 0                 /* Block until a slot is freed. */
+#define UP_POLICY_REJECT 1                /* Fail with `UP_ERROR_QUEUE_FULL`. */
+#define UP_POLICY_CALLER_RUNS 2           /* Run the task in the caller's thread. */
+
+/* Priority levels of tasks. */
+#define UP_PRIO_LOW 0                     /* Background work. */
+#define UP_PRIO_NORMAL 1                  /* Default for `up_pool_submit`. */
+#define UP_PRIO_HIGH 2                    /* Latency critical work. */
+#define UP_PRIO_LEVELS 3
+
+/* Placement of the workers of `up_pool_create_numa`. */
+#define UP_AFFINITY_NONE 0                /* Workers are not pinned, one node. */
+#define UP_AFFINITY_NODE 1                /* Pinned to the CPUs of their node. */
+#define UP_AFFINITY_CPU 2                 /* Pinned to a CPU of their node. */
+
+/* Task queue implementations of `up_pool_attr_t`. */
+#define UP_QUEUE_LIST 0                   /* Unbounded two-lock linked list. */
+#define UP_QUEUE_RING 1                   /* Bounded preallocated ring. */
+
+/* Queue implementation of `up_pool_attr_init`, may be set at compile time. */
+#ifndef UP_QUEUE_DEFAULT
+#define UP_QUEUE_DEFAULT UP_QUEUE_LIST
+#endif
+
+/* Scheduling policy of `up_pool_attr_t` inheriting the creator's one. */
+#define UP_SCHED_INHERIT -1
+
+/* The NUMA node of the caller for `up_pool_submit_node`. */
+#define UP_NODE_LOCAL -1
+
+/* Readiness of a file descriptor awaited by `up_pool_submit_on_fd`. */
+#define UP_FD_READ 1
+#define UP_FD_WRITE 2
+
+/* Maximum size of the payload of `up_pool_submit_copy`, so that a task
+ * fits in a cache line. */
+#define UP_INLINE_SIZE 40
+
+/* Number of buckets of the latency histograms of `up_stats_t`. */
+#define UP_STATS_BUCKETS 40
+
+/* Statistics of a pool or of one of its workers. Bucket `i` of the
+ * histograms counts the tasks that took [2^i, 2^(i+1)) nanoseconds, the
+ * last one also counts longer ones. */
+typedef struct up_stats {
+    unsigned long executed;               /* Tasks executed, not cancelled. */
+    unsigned long cancelled;              /* Tasks skipped, their token cancelled. */
+    unsigned long busy_ns;                /* Time spent running tasks. */
+    unsigned long idle_ns;                /* Time spent waiting for tasks. */
+    unsigned long enq_contended;          /* Waits for the lock of the queue's tail. */
+    unsigned long deq_contended;          /* Waits for the lock of the queue's head. */
+    unsigned long wait_hist[UP_STATS_BUCKETS]; /* Time from submit to start. */
+    unsigned long run_hist[UP_STATS_BUCKETS];  /* Time from start to end. */
+} up_stats_t;
+
+/* Attributes of a new thread pool, see `up_pool_create_ex`. */
+typedef struct up_pool_attr {
+    size_t max_threads;                   /* Number of threads, the maximum if elastic. */
+    size_t min_threads;                   /* Threads an elastic pool keeps, 0 if not elastic. */
+    int queue;                            /* `UP_QUEUE_LIST` or `UP_QUEUE_RING`. */
+    size_t capacity;                      /* Slots of a `UP_QUEUE_RING` queue. */
+    int affinity;                         /* Placement of the workers on the NUMA nodes. */
+    size_t stack_size;                    /* Stack size of the workers' threads. */
+    size_t guard_size;                    /* Guard area past the workers' stacks. */
+    int sched_policy;                     /* Scheduling policy of the workers' threads. */
+    int sched_priority;                   /* Their priority under `sched_policy`. */
+    const char *name;                     /* Prefix of the workers' names, or NULL. */
+} up_pool_attr_t;
 
 /* The thread pool. */
 typedef struct up_pool up_pool_t;
 
+/* A producer registered with `up_pool_producer_register`. */
+typedef struct up_producer up_producer_t;
+
+/* A task group, see `up_pool_group_create`. */
+typedef struct up_group up_group_t;
+
+/* A periodic task, see `up_pool_submit_every`. */
+typedef struct up_timer up_timer_t;
+
+/* A cancellation token, see `up_pool_submit_token`. */
+typedef struct up_token up_token_t;
+
+/* A worker's scratch arena, see `up_pool_worker_ctx`. */
+typedef struct up_arena up_arena_t;
+
+/* The context of a worker, see `up_pool_worker_ctx`. */
+typedef struct up_worker_ctx {
+    size_t index;                         /* Index of the worker in its pool. */
+    up_arena_t *arena;                    /* Scratch arena of the worker. */
+} up_worker_ctx_t;
+
+/* A handle to a submitted task. */
+typedef struct up_task_handle up_task_handle_t;
+
 /* Create a new thread pool. */
 int up_pool_create(up_pool_t **pool, size_t n);
 
-/* Destroy the thread pool. */
+/* Set `attr` to the defaults: one thread per online CPU, a queue of
+ * `UP_QUEUE_DEFAULT` with 1024 slots if bounded, no affinity, the
+ * system's stack and guard sizes and the creator's scheduling policy. */
+int up_pool_attr_init(up_pool_attr_t *attr);
+
+/* Create a new thread pool as described by `attr`. Worker `i` is named
+ * `<name>-<i>`, the name cut to 10 characters, on Linux. Fails with
+ * `UP_ERROR_CONF_INVAL` on invalid attributes, a stack smaller than
+ * `PTHREAD_STACK_MIN` or than its guard area, or an unknown scheduling
+ * policy or a priority out of its range, and `UP_ERROR_THREAD_CREATE`
+ * if the policy is not permitted, `*pool` then being left untouched. */
+int up_pool_create_ex(up_pool_t **pool, const up_pool_attr_t *attr);
+
+/* Create a new thread pool backed by a preallocated queue of `capacity`
+ * slots (rounded up to a power of two). Submitting never allocates. */
+int up_pool_create_bounded(up_pool_t **pool, size_t n, size_t capacity);
+
+/* Create a new thread pool of `min` to `max` threads. Workers are added
+ * while tasks queue up and retire after idling, see `up_pool_set_elastic`. */
+int up_pool_create_elastic(up_pool_t **pool, size_t min, size_t max);
+
+/* Set the number of queued tasks above which an elastic pool with no idle
+ * worker adds one (default 32), and the time in nanoseconds after which
+ * an idle worker retires (default 1s). */
+int up_pool_set_elastic(up_pool_t *pool, size_t grow_depth, unsigned long idle_ns);
+
+/* Set the time in nanoseconds a task may wait in queue before an elastic
+ * pool with no idle worker adds one, 0 to only grow on depth (default).
+ * Only timed tasks are measured, see `up_pool_set_stats`. */
+int up_pool_set_grow_wait(up_pool_t *pool, unsigned long wait_ns);
+
+/* Store the number of running threads of the pool in `count`. */
+int up_pool_thread_count(up_pool_t *pool, size_t *count);
+
+/* Create a new thread pool whose workers are spread over the NUMA nodes
+ * the process may run on and pinned according to `affinity`. Each node
+ * has its own queue, see `up_pool_submit_node`. */
+int up_pool_create_numa(up_pool_t **pool, size_t n, int affinity);
+
+/* Store the number of NUMA nodes of the pool in `count`, at least 1. */
+int up_pool_node_count(up_pool_t *pool, size_t *count);
+
+/* Set the full queue policy of a bounded pool (default `UP_POLICY_BLOCK`). */
+int up_pool_set_full_policy(up_pool_t *pool, int policy);
+
+/* Set the time in nanoseconds an idle worker spins, looking for tasks,
+ * before parking (default 20us). */
+int up_pool_set_spin(up_pool_t *pool, unsigned long spin_ns);
+
+/* Enable or disable the low latency mode: idle workers spin without ever
+ * parking, trading CPU time for the latency of waking them up. */
+int up_pool_set_low_latency(up_pool_t *pool, int enable);
+
+/* Enable or disable timing tasks (default disabled). Timing fills the
+ * histograms and `busy_ns` of the statistics and costs a clock read at
+ * submit and two at execution per task, the other statistics are always
+ * collected. */
+int up_pool_set_stats(up_pool_t *pool, int enable);
+
+/* Set the hooks each worker calls with `ctx` and its index in its own
+ * thread: `on_start` before the first task it executes from now on,
+ * `on_stop` when it exits or retires, if it called `on_start`. Either
+ * may be NULL. Fails with `UP_ERROR_CONF_INVAL` if already set. */
+int up_pool_set_worker_hooks(up_pool_t *pool, void (*on_start) (void *, size_t),
+                             void (*on_stop) (void *, size_t), void *ctx);
+
+/* Store in `ctx` the context of the worker running the calling task.
+ * Fails with `UP_ERROR_CONF_INVAL` outside a worker. */
+int up_pool_worker_ctx(up_worker_ctx_t *ctx);
+
+/* Allocate `size` bytes of scratch memory, aligned on 16 bytes, from a
+ * worker's arena, or return NULL if out of memory. Only the task running
+ * on the worker may allocate from its arena. The memory is released when
+ * the task returns, or a fiber switches out, without locks nor calls to
+ * `free`. */
+void *up_arena_alloc(up_arena_t *arena, size_t size);
+
+/* Store in `stats` the statistics of the whole pool, lock contention of
+ * producers outside of the pool included. */
+int up_pool_stats(up_pool_t *pool, up_stats_t *stats);
+
+/* Store in `stats` the statistics of the `i`-th worker, fails with
+ * `UP_ERROR_CONF_INVAL` past the last one. */
+int up_pool_worker_stats(up_pool_t *pool, size_t i, up_stats_t *stats);
+
+/* Stop the pool's workers, without freeing the pool. From now on tasks
+ * are rejected with `UP_ERROR_SHUTDOWN`, but in `UP_SHUTDOWN_DRAIN` mode
+ * running tasks may still submit. Blocks until the workers exit or the
+ * absolute `CLOCK_REALTIME` time `abstime` (if not NULL) passes, then a
+ * drain turns into a discard and `UP_ERROR_TIMEDOUT` is returned. Tasks
+ * never run don't complete their handles. */
+int up_pool_shutdown(up_pool_t *pool, int mode, const struct timespec *abstime);
+
+/* Destroy the thread pool, draining it first unless already shut down. */
 int up_pool_destroy(up_pool_t *pool);
 
-/* Submit a new task to the pool's queue. Blocks until the task is enqueued. */
+/* Submit a new task to the pool's queue. Blocks until the task is enqueued.
+ * Tasks submitted from a task of the same pool are pushed to the running
+ * worker's own deque, from which idle workers steal. */
 int up_pool_submit(up_pool_t *pool, void (*task_routine) (void *), void *arg);
 
-/* Return the number of enqueued tasks (not yet executed). */
+/* Submit a new task without blocking. Fails with `UP_ERROR_QUEUE_FULL` if a
+ * bounded queue is full or `UP_ERROR_MUTEX_BUSY` if the queue is locked. */
+int up_pool_try_submit(up_pool_t *pool, void (*task_routine) (void *), void *arg);
+
+/* Submit a new task, blocking on a full bounded queue at most until the
+ * absolute `CLOCK_REALTIME` time `abstime`, then fail with `UP_ERROR_TIMEDOUT`. */
+int up_pool_submit_timed(up_pool_t *pool, void (*task_routine) (void *), void *arg,
+                         const struct timespec *abstime);
+
+/* Register the calling thread as a producer with a lane of its own,
+ * through which `up_producer_submit` takes no shared lock. Workers poll
+ * the lanes in turn before the pool's queue. Fails with
+ * `UP_ERROR_CONF_INVAL` if 64 producers are already registered. */
+int up_pool_producer_register(up_pool_t *pool, up_producer_t **producer);
+
+/* Unregister the producer, its tasks still queued are executed. */
+int up_pool_producer_unregister(up_producer_t *producer);
+
+/* Submit a new task through the producer's lane. Only the registered
+ * thread may call it. A full lane falls back to `up_pool_submit`. */
+int up_producer_submit(up_producer_t *producer, void (*task_routine) (void *), void *arg);
+
+/* Submit a new task to the strand of `key`: tasks of the same key run in
+ * submission order, one at a time, while tasks of other keys run in
+ * parallel, so they need no lock for the state of their key. A worker
+ * runs up to 32 tasks of a strand in a row. Keys are hashed to one of
+ * 1024 strands, keys sharing one are serialized together. */
+int up_pool_submit_keyed(up_pool_t *pool, unsigned long key,
+                         void (*task_routine) (void *), void *arg);
+
+/* Create a task group of weight `weight`, for a tenant sharing the pool.
+ * Groups with queued tasks are served by deficit round robin, each gets
+ * a share of the tasks taken from the groups in proportion to its weight.
+ * Groups are served before the pool's queue, so tenants should all
+ * submit through groups. Fails with `UP_ERROR_CONF_INVAL` if `weight` is
+ * 0 or 64 groups are already created. */
+int up_pool_group_create(up_pool_t *pool, size_t weight, up_group_t **group);
+
+/* Destroy the group, its tasks still queued are executed. Its slot is
+ * not given to a new group before they are all taken. */
+int up_pool_group_destroy(up_group_t *group);
+
+/* Submit a new task to the group. Fails with `UP_ERROR_CONF_INVAL` once
+ * the group is destroyed. */
+int up_group_submit(up_group_t *group, void (*task_routine) (void *), void *arg);
+
+/* Submit a new task to be queued once `delay_ns` nanoseconds have passed,
+ * rounded up to the millisecond. Timers are kept in a timer wheel
+ * serviced by a thread of the pool, started with the first timer. They
+ * don't count for `up_pool_wait` and are dropped at shutdown. */
+int up_pool_submit_delayed(up_pool_t *pool, unsigned long delay_ns,
+                           void (*task_routine) (void *), void *arg);
+
+/* Submit a new task to be queued every `period_ns` nanoseconds, starting
+ * one period from now, and return in `timer` (if not NULL) a handle to
+ * cancel it. The timer is freed with the pool if never cancelled. */
+int up_pool_submit_every(up_pool_t *pool, unsigned long period_ns,
+                         void (*task_routine) (void *), void *arg, up_timer_t **timer);
+
+/* Stop a periodic task, runs already queued are still executed. */
+int up_timer_cancel(up_timer_t *timer);
+
+/* Submit a new task to be queued once `fd` is ready for `events`, a mask
+ * of `UP_FD_READ` and `UP_FD_WRITE`, so that no worker blocks on it. The
+ * fd is waited for by a thread of the pool with epoll, started with the
+ * first wait. Fails with `UP_ERROR_CONF_INVAL` if `fd` is invalid,
+ * already waited for, or the platform has no epoll. Waits don't count
+ * for `up_pool_wait` and are dropped at shutdown. */
+int up_pool_submit_on_fd(up_pool_t *pool, int fd, int events,
+                         void (*task_routine) (void *), void *arg);
+
+/* Create a new cancellation token, `cleanup` (if not NULL) is called with
+ * the arg of each task of the token skipped once cancelled. */
+int up_pool_token_create(up_pool_t *pool, void (*cleanup) (void *), up_token_t **token);
+
+/* Submit a new task with a token. Once the token is cancelled the task
+ * is skipped, and its arg cleaned up, instead of being run, if it has
+ * not started. */
+int up_pool_submit_token(up_pool_t *pool, up_token_t *token,
+                         void (*task_routine) (void *), void *arg);
+
+/* Cancel the tasks of the token in O(1): the queued ones, and the ones
+ * submitted afterwards, are skipped when taken. Running ones go on. */
+int up_pool_cancel(up_token_t *token);
+
+/* Release the token, it must not be used afterwards. Its tasks still
+ * queued keep it alive until they are taken. */
+int up_token_release(up_token_t *token);
+
+/* Submit a new task to run on a fiber, a 64 KiB stack of its own taken
+ * from the pool, so that it can call `up_task_yield` and suspend in
+ * `up_task_wait` without holding its worker, which meanwhile executes
+ * other tasks. A fiber may resume on another worker. */
+int up_pool_submit_fiber(up_pool_t *pool, void (*task_routine) (void *), void *arg);
+
+/* Switch the calling fiber out and resume it after the worker executed
+ * another task, if any. Fails with `UP_ERROR_CONF_INVAL` outside a fiber. */
+int up_task_yield(void);
+
+/* Submit a new task whose argument is a copy of the `len` bytes at
+ * `data`, stored in the task itself. The routine gets a pointer to the
+ * copy, suitably aligned and valid until it returns. Fails with
+ * `UP_ERROR_CONF_INVAL` if `len` exceeds `UP_INLINE_SIZE`. */
+int up_pool_submit_copy(up_pool_t *pool, void (*task_routine) (void *), const void *data,
+                        size_t len);
+
+/* Submit a new task with priority `prio`. Tasks of the highest non-empty
+ * level are executed first, lower levels are aged so they don't starve.
+ * `UP_PRIO_NORMAL` tasks are the ones of `up_pool_submit`, the other
+ * levels are never bounded. */
+int up_pool_submit_prio(up_pool_t *pool, void (*task_routine) (void *), void *arg,
+                        int prio);
+
+/* Submit a new task to the queue of NUMA node `node`, numbered from 0 in
+ * the system's order, or of the caller's node if `UP_NODE_LOCAL`. Workers
+ * of the node run it first, the others only when out of work. */
+int up_pool_submit_node(up_pool_t *pool, void (*task_routine) (void *), void *arg,
+                        int node);
+
+/* Submit `n` new tasks, the i-th running `task_routines[i]` with `args[i]`.
+ * The tasks are enqueued with one lock round-trip. On a bounded queue that
+ * fills up the full queue policy applies to the remaining tasks, if one is
+ * rejected the tasks before it remain submitted. */
+int up_pool_submit_batch(up_pool_t *pool, void (*task_routines[]) (void *), void *args[],
+                         size_t n);
+
+/* Return the number of enqueued tasks (not yet executed). Never blocks nor
+ * takes a lock, so it is cheap to poll; the result is a snapshot that
+ * concurrent submits and takes may already have changed. */
 int up_pool_queue_size(up_pool_t *pool, size_t *size);
 
+/* Block until every submitted task has completed, including the tasks
+ * they submitted. Fails with `UP_ERROR_DEADLOCK` if called from a task. */
+int up_pool_wait(up_pool_t *pool);
+
+/* Same as `up_pool_wait` but wait at most until the absolute `CLOCK_REALTIME`
+ * time `abstime`, then fail with `UP_ERROR_TIMEDOUT`. */
+int up_pool_wait_timed(up_pool_t *pool, const struct timespec *abstime);
+
+/* Submit a new task and return in `handle` a handle to wait for the value
+ * returned by `task_routine`. Handles are recycled by the pool, every
+ * handle must be released with `up_task_release` before the pool is
+ * destroyed. */
+int up_pool_submit_handle(up_pool_t *pool, void *(*task_routine) (void *), void *arg,
+                          up_task_handle_t **handle);
+
+/* Submit a new task that runs once the `n` tasks of `deps` have completed,
+ * and return in `handle` (if not NULL) a handle to it, usable as a
+ * dependency of further tasks. The last dependency to complete runs one
+ * of its ready successors right after it on the same worker and submits
+ * the others. The handles of `deps` must be valid during the call. */
+int up_pool_submit_after(up_pool_t *pool, up_task_handle_t *deps[], size_t n,
+                         void *(*task_routine) (void *), void *arg,
+                         up_task_handle_t **handle);
+
+/* Block until the task has completed and store its result in `result`
+ * (if not NULL). Called from a task, executes other tasks meanwhile, a
+ * fiber is suspended instead. */
+int up_task_wait(up_task_handle_t *handle, void **result);
+
+/* Same as `up_task_wait` but fail with `UP_ERROR_PENDING` instead of
+ * blocking if the task has not completed. */
+int up_task_try_wait(up_task_handle_t *handle, void **result);
+
+/* Release the handle, it must not be used afterwards. */
+int up_task_release(up_task_handle_t *handle);
+
+/* Call `body(ctx, first, last)` on chunks of [begin, end) in parallel and
+ * return when the whole range is processed. Chunks have at least `grain`
+ * indexes (0 picks 1) and shrink as the range runs out. */
+int up_pool_parallel_for(up_pool_t *pool, size_t begin, size_t end, size_t grain,
+                         void (*body) (void *, size_t, size_t), void *ctx);
+
+/* Same as `up_pool_parallel_for` but `body(ctx, first, last, acc)` also
+ * accumulates into `acc`, a private copy of the `size` bytes at `result`,
+ * which must hold the identity of the reduction. Once the range is
+ * processed every copy is merged into `result` with
+ * `combine(ctx, result, acc)`. */
+int up_pool_parallel_reduce(up_pool_t *pool, size_t begin, size_t end, size_t grain,
+                            void (*body) (void *, size_t, size_t, void *),
+                            void (*combine) (void *, void *, const void *),
+                            void *ctx, void *result, size_t size);
+
 #endif
@@ -9,6 +9,58 @@
 #define assert_not_equals(a, b) \
     do { if (a == b) return 1; } while (0)
 
+typedef struct TestSpawnContext {
+    up_pool_t *pool;
+    size_t depth;
+    size_t *count;
+} TestSpawnContext;
+
+typedef struct TestOrderContext {
+    size_t count;
+    int ids[128];
+} TestOrderContext;
+
+typedef struct TestOrderTask {
+    TestOrderContext *order;
+    int id;
+} TestOrderTask;
+
+typedef struct TestCopyPayload {
+    size_t *sum;
+    size_t value;
+} TestCopyPayload;
+
+typedef struct TestFiberContext {
+    size_t arrived;
+    size_t count;
+    int yield_retv;
+    up_task_handle_t *handle;
+    up_pool_t *pool;
+} TestFiberContext;
+
+typedef struct TestHooksContext {
+    size_t started;
+    size_t stopped;
+    size_t allocated;
+} TestHooksContext;
+
+typedef struct TestKeyState {
+    int running;
+    size_t next;
+    size_t errors;
+} TestKeyState;
+
+typedef struct TestKeyedTask {
+    TestKeyState *state;
+    size_t seq;
+} TestKeyedTask;
+
+typedef struct TestThreadAttr {
+    int retv;
+    size_t stack_size;
+    char name[16];
+} TestThreadAttr;
+
 typedef struct TestConsumerContext {
     int out;
     pthread_t thread_id;
@@ -22,6 +74,10 @@ void run(char *desc,
          void (test_teardown) (void *));
 
 void *setup_pool();
+void *setup_bounded_pool();
+void *setup_single_pool();
+void *setup_numa_pool();
+void *setup_elastic_pool();
 void teardown_pool(void *context);
 
 int test_pool_enq_deq_locked(void *context);
@@ -29,9 +85,55 @@ int test_pool_deq_enq_locked(void *context);
 int test_pool_destroy_during_execution(void *context);
 int test_pool_submit_lock_fails(void *context);
 int test_pool_queue_size(void *context);
+int test_pool_bounded_full(void *context);
+int test_pool_spawn_from_task(void *context);
+int test_pool_submit_batch(void *context);
+int test_pool_idle_parking(void *context);
+int test_pool_wait(void *context);
+int test_task_handle(void *context);
+int test_pool_parallel(void *context);
+int test_pool_priority(void *context);
+int test_pool_numa(void *context);
+int test_pool_elastic(void *context);
+int test_pool_shutdown(void *context);
+int test_pool_stats(void *context);
+int test_pool_submit_copy(void *context);
+int test_task_after(void *context);
+int test_pool_producer(void *context);
+int test_pool_timer(void *context);
+int test_pool_timer_destroy(void *context);
+int test_pool_fd(void *context);
+int test_pool_fiber(void *context);
+int test_pool_worker_ctx(void *context);
+int test_pool_cancel(void *context);
+int test_pool_group(void *context);
+int test_pool_keyed(void *context);
+int test_pool_create_ex(void *context);
 
 void consumer_routine(void *arg);
 void consumer_routine_sleeper(void *arg);
+void consumer_routine_self(void *arg);
+void consumer_routine_spawn(void *arg);
+void consumer_routine_count(void *arg);
+void *consumer_routine_next(void *arg);
+void *consumer_routine_sleeper_handle(void *arg);
+void consumer_routine_mark(void *arg, size_t begin, size_t end);
+void consumer_routine_sum(void *arg, size_t begin, size_t end, void *acc);
+void consumer_routine_add(void *arg, void *result, const void *acc);
+void *consumer_routine_reduce(void *arg);
+void consumer_routine_order(void *arg);
+void consumer_routine_copy(void *arg);
+void *consumer_routine_step(void *arg);
+void consumer_routine_barrier(void *arg);
+void consumer_routine_await(void *arg);
+void consumer_routine_loop_yield(void *arg, size_t begin, size_t end);
+void consumer_routine_loop(void *arg);
+void *consumer_routine_awaited(void *arg);
+void consumer_routine_arena(void *arg);
+void consumer_routine_keyed(void *arg);
+void consumer_routine_attr(void *arg);
+void hook_start(void *ctx, size_t index);
+void hook_stop(void *ctx, size_t index);
 
 int main()
 {
@@ -57,9 +159,129 @@ int main()
 
     run("test_pool_queue_size",
         test_pool_queue_size,
+        setup_single_pool,
+        teardown_pool);
+
+    run("test_pool_bounded_full",
+        test_pool_bounded_full,
+        setup_bounded_pool,
+        teardown_pool);
+
+    run("test_pool_spawn_from_task",
+        test_pool_spawn_from_task,
+        setup_pool,
+        teardown_pool);
+
+    run("test_pool_submit_batch",
+        test_pool_submit_batch,
+        setup_pool,
+        teardown_pool);
+
+    run("test_pool_idle_parking",
+        test_pool_idle_parking,
+        setup_pool,
+        teardown_pool);
+
+    run("test_pool_wait",
+        test_pool_wait,
+        setup_pool,
+        teardown_pool);
+
+    run("test_task_handle",
+        test_task_handle,
+        setup_pool,
+        teardown_pool);
+
+    run("test_pool_parallel",
+        test_pool_parallel,
+        setup_pool,
+        teardown_pool);
+
+    run("test_pool_priority",
+        test_pool_priority,
+        setup_single_pool,
+        teardown_pool);
+
+    run("test_pool_numa",
+        test_pool_numa,
+        setup_numa_pool,
+        teardown_pool);
+
+    run("test_pool_elastic",
+        test_pool_elastic,
+        setup_elastic_pool,
+        teardown_pool);
+
+    run("test_pool_shutdown",
+        test_pool_shutdown,
+        NULL,
+        NULL);
+
+    run("test_pool_stats",
+        test_pool_stats,
         setup_pool,
         teardown_pool);
 
+    run("test_pool_submit_copy",
+        test_pool_submit_copy,
+        setup_pool,
+        teardown_pool);
+
+    run("test_task_after",
+        test_task_after,
+        setup_pool,
+        teardown_pool);
+
+    run("test_pool_producer",
+        test_pool_producer,
+        setup_single_pool,
+        teardown_pool);
+
+    run("test_pool_timer",
+        test_pool_timer,
+        setup_pool,
+        teardown_pool);
+
+    run("test_pool_timer_destroy",
+        test_pool_timer_destroy,
+        NULL,
+        NULL);
+
+    run("test_pool_fd",
+        test_pool_fd,
+        setup_pool,
+        teardown_pool);
+
+    run("test_pool_fiber",
+        test_pool_fiber,
+        setup_single_pool,
+        teardown_pool);
+
+    run("test_pool_worker_ctx",
+        test_pool_worker_ctx,
+        setup_pool,
+        teardown_pool);
+
+    run("test_pool_cancel",
+        test_pool_cancel,
+        setup_single_pool,
+        teardown_pool);
+
+    run("test_pool_group",
+        test_pool_group,
+        setup_single_pool,
+        teardown_pool);
+
+    run("test_pool_keyed",
+        test_pool_keyed,
+        setup_pool,
+        teardown_pool);
+
+    run("test_pool_create_ex",
+        test_pool_create_ex,
+        NULL,
+        NULL);
+
     return 0;
 }
 
@@ -72,6 +294,43 @@ void *setup_pool()
     return (void *) pool;
 }
 
+void *setup_bounded_pool()
+{
+    /* Create pool with one thread and two queue slots. */
+    up_pool_t *pool = NULL;
+    up_pool_create_bounded(&pool, 1, 2);
+
+    return (void *) pool;
+}
+
+void *setup_single_pool()
+{
+    /* Create pool with one thread. */
+    up_pool_t *pool = NULL;
+    up_pool_create(&pool, 1);
+
+    return (void *) pool;
+}
+
+void *setup_numa_pool()
+{
+    /* Create pool with two threads pinned to a CPU each. */
+    up_pool_t *pool = NULL;
+    up_pool_create_numa(&pool, 2, UP_AFFINITY_CPU);
+
+    return (void *) pool;
+}
+
+void *setup_elastic_pool()
+{
+    /* Create pool with one to four threads, retiring after 10ms. */
+    up_pool_t *pool = NULL;
+    up_pool_create_elastic(&pool, 1, 4);
+    up_pool_set_elastic(pool, 1, 10000000);
+
+    return (void *) pool;
+}
+
 void teardown_pool(void *context)
 {
     up_pool_t *pool = (up_pool_t *) context;
@@ -182,9 +441,9 @@ void consumer_routine_sleeper(void *arg)
 int test_pool_destroy_during_execution(void *context)
 {
     int retv;
-    size_t i;
-    void *retval;
-    up_node_t *n, *t;
+    size_t count;
+    unsigned long start;
+    struct timespec abstime;
     up_pool_t *pool = (up_pool_t *) context;
 
     /* Initialize TestConsumerContext.
@@ -193,8 +452,8 @@ int test_pool_destroy_during_execution(void *context)
      *
      * `out == 1` -> The consumer thread is starting.
      * `out == 2` -> The consumer thread has started and is waiting for
-     *               the producer to send the cancel signal.
-     * `out == 3` -> The producer has sent the cancel signal, the consumer
+     *               the producer to shut the pool down.
+     * `out == 3` -> The producer has shut the pool down, the consumer
      *               is about to finish executing. */
     TestConsumerContext c;
 
@@ -211,46 +470,34 @@ int test_pool_destroy_during_execution(void *context)
     while (c.out != 2) {
         pthread_cond_wait(&c.cond, &c.lock);
     }
+    pthread_mutex_unlock(&c.lock);
 
-    /* Send cancel signal to thread. */
-    retv = pthread_cancel(c.thread_id);
-    assert_equals(retv, 0);
+    /* Assert that the shutdown gives up at the deadline. */
+    start = up_clock_ns();
+    up_timespec_after(&abstime, 10000000);
+
+    retv = up_pool_shutdown(pool, UP_SHUTDOWN_DRAIN, &abstime);
+    assert_equals(retv, UP_ERROR_TIMEDOUT);
+    assert_equals((up_clock_ns() - start < 1000000000UL), 1);
+
+    /* Assert that new tasks are rejected. */
+    count = 0;
+    retv = up_pool_submit(pool, consumer_routine_count, (void *) &count);
+    assert_equals(retv, UP_ERROR_SHUTDOWN);
 
     /* Allow task to terminate. */
+    pthread_mutex_lock(&c.lock);
     c.out = 3;
     pthread_cond_signal(&c.cond);
     pthread_mutex_unlock(&c.lock);
 
-    /* Assert that the task was cancelled. */
-    retv = pthread_join(c.thread_id, &retval);
-    assert_equals(retv, 0);
-    assert_equals(retval, PTHREAD_CANCELED);
+    /* Assert that the running task is waited for. */
+    retv = up_pool_destroy(pool);
+    assert_equals(retv, UP_SUCCESS);
 
     /* Assert that the routine terminated succesfully. */
     assert_equals(c.out, 0);
-
-    /* Try to destroy the pool. */
-    retv = up_pool_destroy(pool);
-    assert_equals(retv, UP_ERROR_THREAD_JOIN);
-
-    /* Cleanup since `up_pool_destroy` failed. */
-    for (i = 0; i < pool->thread_count; i++) {
-        retv = pthread_join(pool->threads[i], NULL);
-    }
-
-    free(pool->threads);
-
-    pthread_cond_destroy(&pool->cond);
-    pthread_mutex_destroy(&pool->enq_lock);
-    pthread_mutex_destroy(&pool->deq_lock);
-
-    for (n = pool->head; n != NULL; ) {
-        t = n;
-        n = n->next;
-        free(t);
-    }
-
-    free(pool);
+    assert_equals(count, 0);
 
     /* Cleanup TestConsumerContext. */
     pthread_cond_destroy(&c.cond);
@@ -283,14 +530,23 @@ int test_pool_submit_lock_fails(void *context)
 int test_pool_queue_size(void *context)
 {
     int retv;
-    size_t i, s, t;
+    size_t s;
+    TestConsumerContext c;
     up_pool_t *pool = (up_pool_t *) context;
 
-    /* Cancel the threads to keep the tasks from beeing consumed. */
-    for (i = 0; i < pool->thread_count; i++) {
-        pthread_cancel(pool->threads[i]);
-        pthread_join(pool->threads[i], NULL);
+    c.out = 1;
+    pthread_cond_init(&c.cond, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+
+    /* Block the only worker to keep the tasks from beeing consumed. */
+    retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
     }
+    pthread_mutex_unlock(&c.lock);
 
     /* Submit two tasks. */
     retv = up_pool_submit(pool, consumer_routine, NULL);
@@ -299,29 +555,1619 @@ int test_pool_queue_size(void *context)
     retv = up_pool_submit(pool, consumer_routine, NULL);
     assert_equals(retv, UP_SUCCESS);
 
-    /* Assert queue size. */
+    /* Assert queue size, also while the queue's locks are held. */
     retv = up_pool_queue_size(pool, &s);
     assert_equals(retv, UP_SUCCESS);
     assert_equals(s, 2);
 
-    /* Create the consumer threads again. */
-    for (i = 0; i < 4; i++) {
-        pthread_create(&pool->threads[i], NULL, up_pool_worker, pool);
+    pthread_mutex_lock(&pool->enq_lock);
+    pthread_mutex_lock(&pool->deq_lock);
+
+    retv = up_pool_queue_size(pool, &s);
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(s, 2);
+
+    pthread_mutex_unlock(&pool->deq_lock);
+    pthread_mutex_unlock(&pool->enq_lock);
+
+    /* Allow task to terminate. */
+    pthread_mutex_lock(&c.lock);
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    /* Wait for the tasks to be consumed. */
+    up_pool_wait(pool);
+
+    retv = up_pool_queue_size(pool, &s);
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(s, 0);
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+
+    return 0;
+}
+
+void consumer_routine_self(void *arg)
+{
+    *(pthread_t *) arg = pthread_self();
+}
+
+int test_pool_bounded_full(void *context)
+{
+    int retv;
+    size_t s;
+    pthread_t self;
+    struct timespec abstime;
+    TestConsumerContext c;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    c.out = 1;
+    pthread_cond_init(&c.cond, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+
+    /* Occupy the only thread. */
+    retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
     }
+    pthread_mutex_unlock(&c.lock);
+
+    /* Fill the queue. */
+    retv = up_pool_submit(pool, consumer_routine, NULL);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_submit(pool, consumer_routine, NULL);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_queue_size(pool, &s);
+    assert_equals(s, 2);
+
+    /* Assert the queue is full for every policy. */
+    retv = up_pool_try_submit(pool, consumer_routine, NULL);
+    assert_equals(retv, UP_ERROR_QUEUE_FULL);
+
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_nsec += 10000000;
+    if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec += 1;
+        abstime.tv_nsec -= 1000000000;
+    }
+
+    retv = up_pool_submit_timed(pool, consumer_routine, NULL, &abstime);
+    assert_equals(retv, UP_ERROR_TIMEDOUT);
+
+    retv = up_pool_set_full_policy(pool, UP_POLICY_REJECT);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_submit(pool, consumer_routine, NULL);
+    assert_equals(retv, UP_ERROR_QUEUE_FULL);
+
+    retv = up_pool_set_full_policy(pool, UP_POLICY_CALLER_RUNS);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_submit(pool, consumer_routine_self, (void *) &self);
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(pthread_equal(self, pthread_self()), 1);
+
+    /* Release the thread and wait for the queue to drain. */
+    pthread_mutex_lock(&c.lock);
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
 
-    /* Wait for all the threads to be created.
-     *
-     * Eventually the tasks will be consumed too so:
-     *      `deq_count` = 2 (tasks) + 4 (threads) = 6. */
     do {
-        pthread_mutex_lock(&pool->deq_lock);
+        up_pool_queue_size(pool, &s);
+    } while (s != 0);
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+
+    return 0;
+}
 
-        t = pool->deq_count;
+void consumer_routine_spawn(void *arg)
+{
+    TestSpawnContext *c = (TestSpawnContext *) arg;
 
-        pthread_mutex_unlock(&pool->deq_lock);
-    } while (t != 6);
+    /* The context of the next level follows the context of this one. */
+    if (c->depth > 0) {
+        up_pool_submit(c->pool, consumer_routine_spawn, (void *) &c[1]);
+        up_pool_submit(c->pool, consumer_routine_spawn, (void *) &c[1]);
+    }
+
+    __atomic_add_fetch(c->count, 1, __ATOMIC_SEQ_CST);
+}
+
+int test_pool_spawn_from_task(void *context)
+{
+    int retv;
+    size_t i, count;
+    TestSpawnContext c[11];
+    up_pool_t *pool = (up_pool_t *) context;
+
+    /* Every task spawns two children until depth zero. */
+    count = 0;
+    for (i = 0; i < 11; i++) {
+        c[i].pool = pool;
+        c[i].depth = 10 - i;
+        c[i].count = &count;
+    }
+
+    retv = up_pool_submit(pool, consumer_routine_spawn, (void *) &c[0]);
+    assert_equals(retv, UP_SUCCESS);
+
+    /* Wait for all 2^11 - 1 tasks. */
+    while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 2047) {
+        sched_yield();
+    }
+
+    /* Assert that only the root task went through the shared queue. */
+    assert_equals(pool->enq_count, 1);
+
+    return 0;
+}
+
+void consumer_routine_count(void *arg)
+{
+    __atomic_add_fetch((size_t *) arg, 1, __ATOMIC_SEQ_CST);
+}
+
+int test_pool_submit_batch(void *context)
+{
+    int retv;
+    size_t i, count;
+    void *args[100];
+    void (*routines[100]) (void *);
+    up_pool_t *pool = (up_pool_t *) context;
 
-     return 0;
+    count = 0;
+    for (i = 0; i < 100; i++) {
+        routines[i] = consumer_routine_count;
+        args[i] = (void *) &count;
+    }
+
+    retv = up_pool_submit_batch(pool, routines, args, 100);
+    assert_equals(retv, UP_SUCCESS);
+
+    /* Assert the whole batch was enqueued at once. */
+    assert_equals(pool->enq_count, 100);
+
+    while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 100) {
+        sched_yield();
+    }
+
+    return 0;
+}
+
+int test_pool_idle_parking(void *context)
+{
+    int retv;
+    size_t count;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    count = 0;
+
+    /* Wait for all the threads to park. */
+    while (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) != pool->thread_count) {
+        sched_yield();
+    }
+
+    retv = up_pool_submit(pool, consumer_routine_count, (void *) &count);
+    assert_equals(retv, UP_SUCCESS);
+
+    while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 1) {
+        sched_yield();
+    }
+
+    /* In low latency mode no thread stays parked. */
+    retv = up_pool_set_low_latency(pool, 1);
+    assert_equals(retv, UP_SUCCESS);
+
+    while (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+
+    retv = up_pool_submit(pool, consumer_routine_count, (void *) &count);
+    assert_equals(retv, UP_SUCCESS);
+
+    while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 2) {
+        sched_yield();
+    }
+
+    retv = up_pool_set_low_latency(pool, 0);
+    assert_equals(retv, UP_SUCCESS);
+
+    return 0;
+}
+
+int test_pool_wait(void *context)
+{
+    int retv;
+    struct timespec abstime;
+    TestConsumerContext c;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    c.out = 1;
+    pthread_cond_init(&c.cond, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+
+    /* Nothing submitted, nothing to wait for. */
+    retv = up_pool_wait(pool);
+    assert_equals(retv, UP_SUCCESS);
+
+    /* Submit a task that will block. */
+    retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    /* Wait for task to start, the queue is then empty. */
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
+    }
+    pthread_mutex_unlock(&c.lock);
+
+    /* Assert that the running task is waited for. */
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_nsec += 10000000;
+    if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec += 1;
+        abstime.tv_nsec -= 1000000000;
+    }
+
+    retv = up_pool_wait_timed(pool, &abstime);
+    assert_equals(retv, UP_ERROR_TIMEDOUT);
+
+    /* Allow task to terminate. */
+    pthread_mutex_lock(&c.lock);
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    retv = up_pool_wait(pool);
+    assert_equals(retv, UP_SUCCESS);
+
+    /* Assert that the routine terminated succesfully. */
+    assert_equals(c.out, 0);
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+
+    return 0;
+}
+
+void *consumer_routine_next(void *arg)
+{
+    return (void *) ((char *) arg + 1);
+}
+
+void *consumer_routine_sleeper_handle(void *arg)
+{
+    consumer_routine_sleeper(arg);
+
+    return arg;
+}
+
+int test_task_handle(void *context)
+{
+    int retv;
+    char buf[2];
+    void *result;
+    TestConsumerContext c;
+    up_task_handle_t *h, *t;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    c.out = 1;
+    pthread_cond_init(&c.cond, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+
+    /* Submit a task that will block. */
+    retv = up_pool_submit_handle(pool, consumer_routine_sleeper_handle, (void *) &c, &h);
+    assert_equals(retv, UP_SUCCESS);
+
+    /* Assert that it has not completed. */
+    retv = up_task_try_wait(h, &result);
+    assert_equals(retv, UP_ERROR_PENDING);
+
+    /* Allow task to terminate. */
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
+    }
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    retv = up_task_wait(h, &result);
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(result, (void *) &c);
+
+    retv = up_task_try_wait(h, &result);
+    assert_equals(retv, UP_SUCCESS);
+
+    up_task_release(h);
+
+    /* Wait for the pool to release the handle as well. */
+    up_pool_wait(pool);
+
+    /* Assert that the handle is recycled. */
+    retv = up_pool_submit_handle(pool, consumer_routine_next, (void *) buf, &t);
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(t, h);
+
+    retv = up_task_wait(t, &result);
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(result, (void *) &buf[1]);
+
+    up_task_release(t);
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+
+    return 0;
+}
+
+void consumer_routine_mark(void *arg, size_t begin, size_t end)
+{
+    size_t i;
+    char *marks = (char *) arg;
+
+    for (i = begin; i < end; i++) {
+        marks[i]++;
+    }
+}
+
+void consumer_routine_sum(void *arg, size_t begin, size_t end, void *acc)
+{
+    size_t i;
+
+    for (i = begin; i < end; i++) {
+        *(size_t *) acc += i;
+    }
+}
+
+void consumer_routine_add(void *arg, void *result, const void *acc)
+{
+    *(size_t *) result += *(const size_t *) acc;
+}
+
+void *consumer_routine_reduce(void *arg)
+{
+    TestSpawnContext *c = (TestSpawnContext *) arg;
+
+    *c->count = 0;
+    up_pool_parallel_reduce(c->pool, 0, c->depth, 0, consumer_routine_sum,
+                            consumer_routine_add, NULL, c->count, sizeof(size_t));
+
+    return NULL;
+}
+
+int test_pool_parallel(void *context)
+{
+    int retv;
+    size_t i, sum, nested;
+    char marks[10000];
+    TestSpawnContext c;
+    up_task_handle_t *h;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    memset(marks, 0, sizeof(marks));
+
+    /* Assert that every index is processed exactly once. */
+    retv = up_pool_parallel_for(pool, 0, 10000, 16, consumer_routine_mark, (void *) marks);
+    assert_equals(retv, UP_SUCCESS);
+
+    for (i = 0; i < 10000; i++) {
+        assert_equals(marks[i], 1);
+    }
+
+    /* Assert that an empty range is a no-op. */
+    retv = up_pool_parallel_for(pool, 10, 10, 0, consumer_routine_mark, (void *) marks);
+    assert_equals(retv, UP_SUCCESS);
+
+    sum = 0;
+    retv = up_pool_parallel_reduce(pool, 0, 10000, 0, consumer_routine_sum,
+                                   consumer_routine_add, NULL, &sum, sizeof(size_t));
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(sum, (size_t) 10000 * 9999 / 2);
+
+    /* Assert that a loop can be run from a task. */
+    c.pool = pool;
+    c.depth = 1000;
+    c.count = &nested;
+
+    retv = up_pool_submit_handle(pool, consumer_routine_reduce, (void *) &c, &h);
+    assert_equals(retv, UP_SUCCESS);
+
+    up_task_wait(h, NULL);
+    up_task_release(h);
+
+    assert_equals(nested, (size_t) 1000 * 999 / 2);
+
+    return 0;
+}
+
+void consumer_routine_order(void *arg)
+{
+    TestOrderTask *t = (TestOrderTask *) arg;
+
+    t->order->ids[t->order->count++] = t->id;
+}
+
+int test_pool_priority(void *context)
+{
+    int retv;
+    size_t i;
+    TestOrderTask t[101];
+    TestOrderContext order;
+    TestConsumerContext c;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    c.out = 1;
+    pthread_cond_init(&c.cond, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+
+    order.count = 0;
+
+    for (i = 0; i < 101; i++) {
+        t[i].order = &order;
+        t[i].id = (int) i;
+    }
+
+    /* Assert that an unknown level is rejected. */
+    retv = up_pool_submit_prio(pool, consumer_routine_order, (void *) &t[0], UP_PRIO_LEVELS);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    /* Block the only worker. */
+    retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
+    }
+
+    /* Submit one task per level, lowest first. */
+    up_pool_submit_prio(pool, consumer_routine_order, (void *) &t[0], UP_PRIO_LOW);
+    up_pool_submit_prio(pool, consumer_routine_order, (void *) &t[1], UP_PRIO_NORMAL);
+    up_pool_submit_prio(pool, consumer_routine_order, (void *) &t[2], UP_PRIO_HIGH);
+
+    /* Allow task to terminate. */
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    up_pool_wait(pool);
+
+    /* Assert that the highest level ran first. */
+    assert_equals(order.count, 3);
+    assert_equals(order.ids[0], 2);
+    assert_equals(order.ids[1], 1);
+    assert_equals(order.ids[2], 0);
+
+    /* Block the worker again behind a low and many high tasks. */
+    order.count = 0;
+    c.out = 1;
+
+    retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
+    }
+
+    up_pool_submit_prio(pool, consumer_routine_order, (void *) &t[0], UP_PRIO_LOW);
+    for (i = 1; i < 101; i++) {
+        up_pool_submit_prio(pool, consumer_routine_order, (void *) &t[i], UP_PRIO_HIGH);
+    }
+
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    up_pool_wait(pool);
+
+    /* Assert that the low task aged and didn't wait for all the others. */
+    assert_equals(order.count, 101);
+    assert_not_equals(order.ids[100], 0);
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+
+    return 0;
+}
+
+int test_pool_numa(void *context)
+{
+    int retv;
+    size_t i, count, nodes;
+    cpu_set_t set;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    retv = up_pool_node_count(pool, &nodes);
+    assert_equals(retv, UP_SUCCESS);
+    assert_not_equals(nodes, 0);
+
+    /* Assert that the workers are pinned to one CPU. */
+    for (i = 0; i < pool->thread_count; i++) {
+        retv = pthread_getaffinity_np(pool->threads[i], sizeof(cpu_set_t), &set);
+        assert_equals(retv, 0);
+        assert_equals(CPU_COUNT(&set), 1);
+    }
+
+    /* Assert that an unknown node is rejected. */
+    retv = up_pool_submit_node(pool, consumer_routine_count, (void *) &count, (int) nodes);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    count = 0;
+    for (i = 0; i < 100; i++) {
+        retv = up_pool_submit_node(pool, consumer_routine_count, (void *) &count,
+                                   i % 2 ? UP_NODE_LOCAL : (int) (i % nodes));
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    up_pool_wait(pool);
+
+    assert_equals(count, 100);
+
+    return 0;
+}
+
+int test_pool_elastic(void *context)
+{
+    int retv;
+    size_t i, count, threads;
+    TestConsumerContext c;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    c.out = 1;
+    pthread_cond_init(&c.cond, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+
+    retv = up_pool_thread_count(pool, &threads);
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(threads, 1);
+
+    /* Block the only worker. */
+    retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
+    }
+    pthread_mutex_unlock(&c.lock);
+
+    /* Assert that queued tasks start new workers, up to the maximum. */
+    count = 0;
+    for (i = 0; i < 100; i++) {
+        retv = up_pool_submit(pool, consumer_routine_count, (void *) &count);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 100) {
+        sched_yield();
+    }
+
+    up_pool_thread_count(pool, &threads);
+    assert_not_equals(threads, 1);
+    assert_equals((threads <= 4), 1);
+
+    /* Allow task to terminate. */
+    pthread_mutex_lock(&c.lock);
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    up_pool_wait(pool);
+
+    /* Assert that idle workers retire, down to the minimum. */
+    for (i = 0; i < 500 && threads != 1; i++) {
+        usleep(10000);
+        up_pool_thread_count(pool, &threads);
+    }
+    assert_equals(threads, 1);
+
+    /* Assert that the remaining worker still runs tasks. */
+    retv = up_pool_submit(pool, consumer_routine_count, (void *) &count);
+    assert_equals(retv, UP_SUCCESS);
+
+    up_pool_wait(pool);
+    assert_equals(count, 101);
+
+    /* Assert that a task waiting too long starts a worker, whatever the
+     * depth. The first one waits behind a blocked worker. */
+    up_pool_set_elastic(pool, (size_t) -1, 10000000);
+    up_pool_set_grow_wait(pool, 1000000);
+    up_pool_set_stats(pool, 1);
+
+    c.out = 1;
+    retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
+    }
+    pthread_mutex_unlock(&c.lock);
+
+    retv = up_pool_submit(pool, consumer_routine_count, (void *) &count);
+    assert_equals(retv, UP_SUCCESS);
+
+    up_pool_thread_count(pool, &threads);
+    assert_equals(threads, 1);
+
+    usleep(5000);
+
+    pthread_mutex_lock(&c.lock);
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    up_pool_wait(pool);
+
+    c.out = 1;
+    retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
+    }
+    pthread_mutex_unlock(&c.lock);
+
+    retv = up_pool_submit(pool, consumer_routine_count, (void *) &count);
+    assert_equals(retv, UP_SUCCESS);
+
+    up_pool_thread_count(pool, &threads);
+    assert_not_equals(threads, 1);
+
+    pthread_mutex_lock(&c.lock);
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    up_pool_wait(pool);
+    assert_equals(count, 103);
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+
+    return 0;
+}
+
+int test_pool_shutdown(void *context)
+{
+    int retv, mode;
+    size_t i, count;
+    up_pool_t *pool;
+    struct timespec abstime;
+    TestConsumerContext c;
+
+    pthread_cond_init(&c.cond, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+
+    for (mode = UP_SHUTDOWN_DRAIN; mode <= UP_SHUTDOWN_DISCARD; mode++) {
+        retv = up_pool_create(&pool, 1);
+        assert_equals(retv, UP_SUCCESS);
+
+        /* Block the only worker and queue tasks behind it. */
+        c.out = 1;
+        retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+        assert_equals(retv, UP_SUCCESS);
+
+        pthread_mutex_lock(&c.lock);
+        while (c.out != 2) {
+            pthread_cond_wait(&c.cond, &c.lock);
+        }
+        pthread_mutex_unlock(&c.lock);
+
+        count = 0;
+        for (i = 0; i < 100; i++) {
+            up_pool_submit(pool, consumer_routine_count, (void *) &count);
+        }
+
+        /* Discard while the task runs, the worker can't exit yet. */
+        if (mode == UP_SHUTDOWN_DISCARD) {
+            up_timespec_after(&abstime, 10000000);
+
+            retv = up_pool_shutdown(pool, mode, &abstime);
+            assert_equals(retv, UP_ERROR_TIMEDOUT);
+        }
+
+        pthread_mutex_lock(&c.lock);
+        c.out = 3;
+        pthread_cond_signal(&c.cond);
+        pthread_mutex_unlock(&c.lock);
+
+        retv = up_pool_shutdown(pool, mode, NULL);
+        assert_equals(retv, UP_SUCCESS);
+
+        /* Assert that the queued tasks ran only when draining. */
+        assert_equals(count, (size_t) (mode == UP_SHUTDOWN_DRAIN ? 100 : 0));
+
+        retv = up_pool_destroy(pool);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+
+    return 0;
+}
+
+int test_pool_stats(void *context)
+{
+    int retv;
+    size_t i, count, timed, executed;
+    up_stats_t stats;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    retv = up_pool_set_stats(pool, 1);
+    assert_equals(retv, UP_SUCCESS);
+
+    count = 0;
+    for (i = 0; i < 100; i++) {
+        retv = up_pool_submit(pool, consumer_routine_count, (void *) &count);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    up_pool_wait(pool);
+
+    /* Assert that every task was counted and timed once. */
+    retv = up_pool_stats(pool, &stats);
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(stats.executed, 100);
+
+    for (i = 0, timed = 0; i < UP_STATS_BUCKETS; i++) {
+        timed += stats.wait_hist[i];
+    }
+    assert_equals(timed, 100);
+
+    for (i = 0, timed = 0; i < UP_STATS_BUCKETS; i++) {
+        timed += stats.run_hist[i];
+    }
+    assert_equals(timed, 100);
+
+    /* Assert that per worker statistics add up to the total. */
+    for (i = 0, executed = 0; i < 4; i++) {
+        retv = up_pool_worker_stats(pool, i, &stats);
+        assert_equals(retv, UP_SUCCESS);
+        executed += stats.executed;
+    }
+    assert_equals(executed, 100);
+
+    retv = up_pool_worker_stats(pool, 4, &stats);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    return 0;
+}
+
+void consumer_routine_copy(void *arg)
+{
+    TestCopyPayload *p = (TestCopyPayload *) arg;
+
+    __atomic_add_fetch(p->sum, p->value, __ATOMIC_SEQ_CST);
+}
+
+int test_pool_submit_copy(void *context)
+{
+    int retv;
+    size_t i, sum;
+    char big[UP_INLINE_SIZE + 1];
+    TestCopyPayload payload;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    /* Assert that each task gets its own copy of the reused payload. */
+    sum = 0;
+    payload.sum = &sum;
+    for (i = 1; i <= 100; i++) {
+        payload.value = i;
+        retv = up_pool_submit_copy(pool, consumer_routine_copy, &payload, sizeof(payload));
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    up_pool_wait(pool);
+    assert_equals(sum, 5050);
+
+    memset(big, 0, sizeof(big));
+    retv = up_pool_submit_copy(pool, consumer_routine_copy, big, sizeof(big));
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    return 0;
+}
+
+/* Return the number of steps run so far, this one included. */
+void *consumer_routine_step(void *arg)
+{
+    return (void *) __atomic_add_fetch((size_t *) arg, 1, __ATOMIC_SEQ_CST);
+}
+
+int test_task_after(void *context)
+{
+    int retv;
+    size_t step;
+    void *a, *b, *c, *d;
+    TestConsumerContext blocker;
+    up_task_handle_t *deps[2], *ha, *hb, *hc, *hd;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    blocker.out = 1;
+    pthread_cond_init(&blocker.cond, NULL);
+    pthread_mutex_init(&blocker.lock, NULL);
+
+    /* Build the diamond a -> (b, c) -> d behind a blocked task. */
+    step = 0;
+    retv = up_pool_submit_handle(pool, consumer_routine_sleeper_handle, (void *) &blocker, &ha);
+    assert_equals(retv, UP_SUCCESS);
+
+    deps[0] = ha;
+    retv = up_pool_submit_after(pool, deps, 1, consumer_routine_step, (void *) &step, &hb);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_submit_after(pool, deps, 1, consumer_routine_step, (void *) &step, &hc);
+    assert_equals(retv, UP_SUCCESS);
+
+    deps[0] = hb;
+    deps[1] = hc;
+    retv = up_pool_submit_after(pool, deps, 2, consumer_routine_step, (void *) &step, &hd);
+    assert_equals(retv, UP_SUCCESS);
+
+    /* Assert that nothing ran before its dependencies. */
+    retv = up_task_try_wait(hb, NULL);
+    assert_equals(retv, UP_ERROR_PENDING);
+
+    retv = up_task_try_wait(hd, NULL);
+    assert_equals(retv, UP_ERROR_PENDING);
+
+    pthread_mutex_lock(&blocker.lock);
+    while (blocker.out != 2) {
+        pthread_cond_wait(&blocker.cond, &blocker.lock);
+    }
+    blocker.out = 3;
+    pthread_cond_signal(&blocker.cond);
+    pthread_mutex_unlock(&blocker.lock);
+
+    up_task_wait(hd, &d);
+    up_task_wait(hb, &b);
+    up_task_wait(hc, &c);
+
+    assert_equals((size_t) d, 3);
+    assert_equals(((size_t) b + (size_t) c), 3);
+
+    /* Assert that completed dependencies don't delay a task. */
+    deps[0] = ha;
+    deps[1] = hd;
+    retv = up_pool_submit_after(pool, deps, 2, consumer_routine_step, (void *) &step, NULL);
+    assert_equals(retv, UP_SUCCESS);
+
+    up_pool_wait(pool);
+    assert_equals(step, 4);
+
+    up_task_wait(ha, &a);
+    assert_equals(a, (void *) &blocker);
+
+    up_task_release(ha);
+    up_task_release(hb);
+    up_task_release(hc);
+    up_task_release(hd);
+
+    pthread_cond_destroy(&blocker.cond);
+    pthread_mutex_destroy(&blocker.lock);
+
+    return 0;
+}
+
+int test_pool_producer(void *context)
+{
+    int retv;
+    size_t i, s, count;
+    TestConsumerContext c;
+    up_producer_t *producer, *other;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    c.out = 1;
+    pthread_cond_init(&c.cond, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+
+    retv = up_pool_producer_register(pool, &producer);
+    assert_equals(retv, UP_SUCCESS);
+
+    /* Block the only worker. */
+    retv = up_producer_submit(producer, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
+    }
+    pthread_mutex_unlock(&c.lock);
+
+    /* Fill the lane and overflow to the pool's queue. */
+    count = 0;
+    for (i = 0; i < 2000; i++) {
+        retv = up_producer_submit(producer, consumer_routine_count, (void *) &count);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    retv = up_pool_queue_size(pool, &s);
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(s, 2000);
+    assert_not_equals(pool->enq_count, 0);
+
+    /* Assert that a lane is reused once unregistered. */
+    retv = up_pool_producer_unregister(producer);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_producer_register(pool, &other);
+    assert_equals(retv, UP_SUCCESS);
+    assert_equals(other, producer);
+
+    pthread_mutex_lock(&c.lock);
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    up_pool_wait(pool);
+    assert_equals(count, 2000);
+
+    up_pool_producer_unregister(other);
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+
+    return 0;
+}
+
+int test_pool_timer(void *context)
+{
+    int retv;
+    size_t i, count, periodic;
+    unsigned long start;
+    up_timer_t *timer;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    /* Assert that a delayed task runs after its delay. */
+    count = 0;
+    start = up_clock_ns();
+
+    retv = up_pool_submit_delayed(pool, 20000000, consumer_routine_count, (void *) &count);
+    assert_equals(retv, UP_SUCCESS);
+
+    while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 1) {
+        usleep(1000);
+    }
+    assert_equals((up_clock_ns() - start >= 20000000), 1);
+
+    /* Assert that many timers of different delays all expire. */
+    for (i = 0; i < 1000; i++) {
+        retv = up_pool_submit_delayed(pool, (i % 100) * 3000000, consumer_routine_count,
+                                      (void *) &count);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 1001) {
+        usleep(1000);
+    }
+
+    /* Assert that a periodic task repeats until cancelled. */
+    periodic = 0;
+    retv = up_pool_submit_every(pool, 2000000, consumer_routine_count, (void *) &periodic,
+                                &timer);
+    assert_equals(retv, UP_SUCCESS);
+
+    while (__atomic_load_n(&periodic, __ATOMIC_SEQ_CST) < 3) {
+        usleep(1000);
+    }
+
+    retv = up_timer_cancel(timer);
+    assert_equals(retv, UP_SUCCESS);
+
+    up_pool_wait(pool);
+    count = periodic;
+
+    usleep(10000);
+    up_pool_wait(pool);
+    assert_equals(periodic, count);
+
+    retv = up_pool_submit_every(pool, 0, consumer_routine_count, (void *) &periodic, NULL);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    return 0;
+}
+
+int test_pool_timer_destroy(void *context)
+{
+    int retv;
+    size_t i, count;
+    up_pool_t *pool;
+
+    /* Assert that pools are destroyed while their timer thread waits with
+     * no timer armed, however the shutdown races with its wait. */
+    for (i = 0; i < 200; i++) {
+        retv = up_pool_create(&pool, 2);
+        assert_equals(retv, UP_SUCCESS);
+
+        count = 0;
+        retv = up_pool_submit_delayed(pool, 0, consumer_routine_count, (void *) &count);
+        assert_equals(retv, UP_SUCCESS);
+
+        while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 1) {
+            sched_yield();
+        }
+
+        retv = up_pool_destroy(pool);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    return 0;
+}
+
+int test_pool_fd(void *context)
+{
+    int retv;
+    int fds[16][2];
+    char byte = 0;
+    size_t i, count;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    for (i = 0; i < 16; i++) {
+        assert_equals(pipe(fds[i]), 0);
+    }
+
+    /* Assert that a task waiting to read doesn't run before a write. */
+    count = 0;
+    retv = up_pool_submit_on_fd(pool, fds[0][0], UP_FD_READ, consumer_routine_count,
+                                (void *) &count);
+    assert_equals(retv, UP_SUCCESS);
+
+    usleep(10000);
+    assert_equals(__atomic_load_n(&count, __ATOMIC_SEQ_CST), 0);
+
+    assert_equals(write(fds[0][1], &byte, 1), 1);
+    while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 1) {
+        usleep(1000);
+    }
+
+    /* Assert that tasks waiting for many fds all run, the first again. */
+    for (i = 0; i < 16; i++) {
+        retv = up_pool_submit_on_fd(pool, fds[i][0], UP_FD_READ, consumer_routine_count,
+                                    (void *) &count);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    for (i = 1; i < 16; i++) {
+        assert_equals(write(fds[i][1], &byte, 1), 1);
+    }
+
+    while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 17) {
+        usleep(1000);
+    }
+
+    /* Assert that a task waiting to write runs at once on an empty pipe. */
+    retv = up_pool_submit_on_fd(pool, fds[1][1], UP_FD_WRITE, consumer_routine_count,
+                                (void *) &count);
+    assert_equals(retv, UP_SUCCESS);
+
+    while (__atomic_load_n(&count, __ATOMIC_SEQ_CST) != 18) {
+        usleep(1000);
+    }
+
+    retv = up_pool_submit_on_fd(pool, fds[0][0], 4, consumer_routine_count, (void *) &count);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    retv = up_pool_submit_on_fd(pool, -1, UP_FD_READ, consumer_routine_count, (void *) &count);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    up_pool_wait(pool);
+
+    for (i = 0; i < 16; i++) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+
+    return 0;
+}
+
+void consumer_routine_barrier(void *arg)
+{
+    TestFiberContext *c = (TestFiberContext *) arg;
+
+    __atomic_add_fetch(&c->arrived, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&c->arrived, __ATOMIC_SEQ_CST) < 1000) {
+        up_task_yield();
+    }
+
+    __atomic_add_fetch(&c->count, 1, __ATOMIC_SEQ_CST);
+}
+
+void *consumer_routine_awaited(void *arg)
+{
+    TestFiberContext *c = (TestFiberContext *) arg;
+
+    c->yield_retv = up_task_yield();
+
+    return arg;
+}
+
+void consumer_routine_await(void *arg)
+{
+    void *result;
+    up_task_handle_t *handle;
+    TestFiberContext *c = (TestFiberContext *) arg;
+
+    while ((handle = __atomic_load_n(&c->handle, __ATOMIC_SEQ_CST)) == NULL) {
+        up_task_yield();
+    }
+
+    if (up_task_wait(handle, &result) == UP_SUCCESS && result == arg) {
+        __atomic_add_fetch(&c->count, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void consumer_routine_loop_yield(void *arg, size_t begin, size_t end)
+{
+    TestFiberContext *c = (TestFiberContext *) arg;
+
+    for ( ; begin < end; begin++) {
+        __atomic_add_fetch(&c->arrived, 1, __ATOMIC_SEQ_CST);
+
+        if (up_task_yield() == UP_ERROR_CONF_INVAL) {
+            __atomic_add_fetch(&c->count, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+void consumer_routine_loop(void *arg)
+{
+    TestFiberContext *c = (TestFiberContext *) arg;
+
+    up_pool_parallel_for(c->pool, 0, 64, 1, consumer_routine_loop_yield, arg);
+}
+
+int test_pool_fiber(void *context)
+{
+    int retv;
+    size_t i;
+    up_task_handle_t *handle;
+    TestFiberContext c;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    /* Assert that 1000 fibers wait for each other on a single worker. */
+    c.arrived = 0;
+    c.count = 0;
+
+    for (i = 0; i < 1000; i++) {
+        retv = up_pool_submit_fiber(pool, consumer_routine_barrier, (void *) &c);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    up_pool_wait(pool);
+    assert_equals(c.count, 1000);
+
+    /* Assert that fibers waiting for a handle don't hold the worker, so
+     * the awaited task doesn't run on a fiber's stack. */
+    c.count = 0;
+    c.yield_retv = UP_SUCCESS;
+    c.handle = NULL;
+
+    for (i = 0; i < 100; i++) {
+        retv = up_pool_submit_fiber(pool, consumer_routine_await, (void *) &c);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    retv = up_pool_submit_handle(pool, consumer_routine_awaited, (void *) &c, &handle);
+    assert_equals(retv, UP_SUCCESS);
+    __atomic_store_n(&c.handle, handle, __ATOMIC_SEQ_CST);
+
+    up_pool_wait(pool);
+    assert_equals(c.count, 100);
+    assert_equals(c.yield_retv, UP_ERROR_CONF_INVAL);
+
+    up_task_release(handle);
+
+    assert_equals(up_task_yield(), UP_ERROR_CONF_INVAL);
+
+    /* Assert that the body of a loop run by a fiber can't park it. */
+    c.arrived = 0;
+    c.count = 0;
+    c.pool = pool;
+
+    for (i = 0; i < 4; i++) {
+        retv = up_pool_submit_fiber(pool, consumer_routine_loop, (void *) &c);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    up_pool_wait(pool);
+    assert_equals(c.arrived, 4 * 64);
+    assert_equals(c.count, 4 * 64);
+
+    return 0;
+}
+
+void hook_start(void *ctx, size_t index)
+{
+    if (index < 4) {
+        __atomic_add_fetch(&((TestHooksContext *) ctx)->started, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void hook_stop(void *ctx, size_t index)
+{
+    if (index < 4) {
+        __atomic_add_fetch(&((TestHooksContext *) ctx)->stopped, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void consumer_routine_arena(void *arg)
+{
+    size_t i;
+    char *small, *big;
+    up_worker_ctx_t ctx;
+    TestHooksContext *c = (TestHooksContext *) arg;
+
+    if (up_pool_worker_ctx(&ctx) != UP_SUCCESS || ctx.index >= 4) {
+        return;
+    }
+
+    /* Past the first block of the arena. */
+    small = (char *) up_arena_alloc(ctx.arena, 3);
+    big = (char *) up_arena_alloc(ctx.arena, 256 * 1024);
+    if (small == NULL || big == NULL || ((size_t) big) % 16 != 0) {
+        return;
+    }
+
+    for (i = 0; i < 256 * 1024; i++) {
+        big[i] = (char) i;
+    }
+
+    __atomic_add_fetch(&c->allocated, 1, __ATOMIC_SEQ_CST);
+}
+
+int test_pool_worker_ctx(void *context)
+{
+    int retv;
+    size_t i;
+    up_worker_ctx_t ctx;
+    TestHooksContext c;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    c.started = 0;
+    c.stopped = 0;
+    c.allocated = 0;
+
+    retv = up_pool_set_worker_hooks(pool, hook_start, hook_stop, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_set_worker_hooks(pool, hook_start, hook_stop, (void *) &c);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    /* Assert that tasks get scratch memory from their worker's arena. */
+    for (i = 0; i < 100; i++) {
+        retv = up_pool_submit(pool, consumer_routine_arena, (void *) &c);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    up_pool_wait(pool);
+    assert_equals(c.allocated, 100);
+
+    /* Assert that the arenas are reset after each task. */
+    for (i = 0; i < 4; i++) {
+        assert_equals((pool->workers[i].arena.block == NULL), 1);
+        assert_equals(pool->workers[i].arena.used, 0);
+    }
+
+    retv = up_pool_worker_ctx(&ctx);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    /* Assert that every started worker is stopped. */
+    retv = up_pool_shutdown(pool, UP_SHUTDOWN_DRAIN, NULL);
+    assert_equals(retv, UP_SUCCESS);
+
+    assert_not_equals(c.started, 0);
+    assert_equals(c.stopped, c.started);
+
+    return 0;
+}
+
+int test_pool_cancel(void *context)
+{
+    int retv;
+    size_t i, cleaned, kept;
+    up_stats_t stats;
+    up_token_t *token, *other;
+    TestConsumerContext c;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    pthread_cond_init(&c.cond, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+
+    retv = up_pool_token_create(pool, consumer_routine_count, &token);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_token_create(pool, NULL, &other);
+    assert_equals(retv, UP_SUCCESS);
+
+    /* Block the only worker and queue tasks of both tokens behind it. */
+    c.out = 1;
+    retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
+    }
+    pthread_mutex_unlock(&c.lock);
+
+    cleaned = 0;
+    kept = 0;
+    for (i = 0; i < 100; i++) {
+        retv = up_pool_submit_token(pool, token, consumer_routine, (void *) &cleaned);
+        assert_equals(retv, UP_SUCCESS);
+
+        retv = up_pool_submit_token(pool, other, consumer_routine_count, (void *) &kept);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    /* Assert that only the tasks of the cancelled token are skipped, and
+     * their args cleaned up, even once the token is released. Run, they
+     * would not count. */
+    retv = up_pool_cancel(token);
+    assert_equals(retv, UP_SUCCESS);
+
+    up_token_release(token);
+
+    pthread_mutex_lock(&c.lock);
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    up_pool_wait(pool);
+
+    assert_equals(cleaned, 100);
+    assert_equals(kept, 100);
+
+    up_pool_stats(pool, &stats);
+    assert_equals(stats.cancelled, 100);
+    assert_equals(stats.executed, 101);
+
+    /* Assert that tasks submitted once cancelled are skipped too. */
+    retv = up_pool_cancel(other);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_submit_token(pool, other, consumer_routine_count, (void *) &kept);
+    assert_equals(retv, UP_SUCCESS);
+
+    up_pool_wait(pool);
+    assert_equals(kept, 100);
+
+    up_token_release(other);
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+
+    return 0;
+}
+
+int test_pool_group(void *context)
+{
+    int retv;
+    size_t i, heavy;
+    up_group_t *groups[2], *group;
+    TestOrderContext order;
+    TestOrderTask tasks[80];
+    TestConsumerContext c;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    pthread_cond_init(&c.cond, NULL);
+    pthread_mutex_init(&c.lock, NULL);
+
+    retv = up_pool_group_create(pool, 3, &groups[0]);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_group_create(pool, 1, &groups[1]);
+    assert_equals(retv, UP_SUCCESS);
+
+    retv = up_pool_group_create(pool, 0, &group);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    /* Block the only worker and queue tasks of both groups behind it. */
+    c.out = 1;
+    retv = up_pool_submit(pool, consumer_routine_sleeper, (void *) &c);
+    assert_equals(retv, UP_SUCCESS);
+
+    pthread_mutex_lock(&c.lock);
+    while (c.out != 2) {
+        pthread_cond_wait(&c.cond, &c.lock);
+    }
+    pthread_mutex_unlock(&c.lock);
+
+    order.count = 0;
+    for (i = 0; i < 80; i++) {
+        tasks[i].order = &order;
+        tasks[i].id = (int) (i % 2);
+
+        retv = up_group_submit(groups[i % 2], consumer_routine_order, (void *) &tasks[i]);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    pthread_mutex_lock(&c.lock);
+    c.out = 3;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+
+    up_pool_wait(pool);
+    assert_equals(order.count, 80);
+
+    /* Assert that, while both have tasks, the groups share the worker 3:1. */
+    for (i = 0, heavy = 0; i < 40; i++) {
+        heavy += order.ids[i] == 0;
+    }
+    assert_equals(heavy, 30);
+
+    up_pool_group_destroy(groups[0]);
+    up_pool_group_destroy(groups[1]);
+
+    /* Assert that a destroyed group takes no new tasks. */
+    retv = up_group_submit(groups[0], consumer_routine_order, (void *) &tasks[0]);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+
+    return 0;
+}
+
+void consumer_routine_keyed(void *arg)
+{
+    size_t i;
+    TestKeyedTask *t = (TestKeyedTask *) arg;
+    TestKeyState *state = t->state;
+
+    if (__atomic_exchange_n(&state->running, 1, __ATOMIC_SEQ_CST) != 0) {
+        __atomic_add_fetch(&state->errors, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (state->next != t->seq) {
+        __atomic_add_fetch(&state->errors, 1, __ATOMIC_SEQ_CST);
+    }
+    state->next = t->seq + 1;
+
+    for (i = 0; i < 100; i++) {
+        sched_yield();
+    }
+
+    __atomic_store_n(&state->running, 0, __ATOMIC_SEQ_CST);
+}
+
+int test_pool_keyed(void *context)
+{
+    int retv;
+    size_t i;
+    TestKeyState states[8];
+    TestKeyedTask *tasks;
+    up_pool_t *pool = (up_pool_t *) context;
+
+    tasks = (TestKeyedTask *) malloc(8 * 200 * sizeof(TestKeyedTask));
+
+    for (i = 0; i < 8; i++) {
+        states[i].running = 0;
+        states[i].next = 0;
+        states[i].errors = 0;
+    }
+
+    /* Assert that the tasks of a key run in order, never overlapping. */
+    for (i = 0; i < 8 * 200; i++) {
+        tasks[i].state = &states[i % 8];
+        tasks[i].seq = i / 8;
+
+        retv = up_pool_submit_keyed(pool, (unsigned long) (i % 8) * 7919, consumer_routine_keyed,
+                                    (void *) &tasks[i]);
+        assert_equals(retv, UP_SUCCESS);
+    }
+
+    up_pool_wait(pool);
+
+    for (i = 0; i < 8; i++) {
+        assert_equals(states[i].next, 200);
+        assert_equals(states[i].errors, 0);
+    }
+
+    free(tasks);
+
+    return 0;
+}
+
+void consumer_routine_attr(void *arg)
+{
+    pthread_attr_t attr;
+    TestThreadAttr *t = (TestThreadAttr *) arg;
+
+    t->retv = pthread_getattr_np(pthread_self(), &attr);
+    if (t->retv == 0) {
+        pthread_attr_getstacksize(&attr, &t->stack_size);
+        pthread_attr_destroy(&attr);
+    }
+
+    pthread_getname_np(pthread_self(), t->name, sizeof(t->name));
+}
+
+int test_pool_create_ex(void *context)
+{
+    int retv;
+    up_pool_t *pool;
+    up_pool_attr_t attr;
+    TestThreadAttr t;
+
+    retv = up_pool_attr_init(&attr);
+    assert_equals(retv, UP_SUCCESS);
+
+    attr.max_threads = 1;
+    attr.queue = UP_QUEUE_RING;
+    attr.capacity = 64;
+    attr.stack_size = 1024 * 1024;
+    attr.name = "uptest";
+
+    retv = up_pool_create_ex(&pool, &attr);
+    assert_equals(retv, UP_SUCCESS);
+    assert_not_equals(pool->ring, NULL);
+
+    /* Assert that the worker got its stack size and name. */
+    retv = up_pool_submit(pool, consumer_routine_attr, (void *) &t);
+    assert_equals(retv, UP_SUCCESS);
+
+    up_pool_wait(pool);
+    assert_equals(t.retv, 0);
+    assert_equals((t.stack_size >= 1024 * 1024), 1);
+    assert_equals(strcmp(t.name, "uptest-0"), 0);
+
+    retv = up_pool_destroy(pool);
+    assert_equals(retv, UP_SUCCESS);
+
+    /* Assert that invalid attributes are rejected. */
+    attr.capacity = 0;
+    retv = up_pool_create_ex(&pool, &attr);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    attr.capacity = 64;
+    attr.stack_size = 1;
+    retv = up_pool_create_ex(&pool, &attr);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    attr.stack_size = 1024 * 1024;
+    attr.guard_size = attr.stack_size;
+    retv = up_pool_create_ex(&pool, &attr);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    attr.guard_size = 0;
+    attr.sched_policy = 12345;
+    retv = up_pool_create_ex(&pool, &attr);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    attr.sched_policy = SCHED_FIFO;
+    attr.sched_priority = sched_get_priority_max(SCHED_FIFO) + 1;
+    retv = up_pool_create_ex(&pool, &attr);
+    assert_equals(retv, UP_ERROR_CONF_INVAL);
+
+    /* Assert that a policy not permitted leaves no pool behind. */
+    attr.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    pool = NULL;
+    retv = up_pool_create_ex(&pool, &attr);
+    if (retv == UP_SUCCESS) {
+        retv = up_pool_destroy(pool);
+        assert_equals(retv, UP_SUCCESS);
+    } else {
+        assert_equals(retv, UP_ERROR_THREAD_CREATE);
+        assert_equals(pool, NULL);
+    }
+
+    return 0;
 }
 
 void run(char *desc,